@@ -9,10 +9,21 @@ struct Ray{
     double t;//光线传播时间，用以确定光线与其他物体的相交点坐标
     double t_min, t_max;
 
+    //水密求交用的光线空间：kz为方向分量绝对值最大的轴，kx、ky依次轮换；Sx、Sy、Sz为把方向剪切成+z的系数
+    int kx, ky, kz;
+    float Sx, Sy, Sz;
+
     Ray(const Vector3f& ori, const Vector3f& dir, const double _t = 0.0): origin(ori), direction(dir),t(_t) {
         direction_inv = Vector3f(1./ direction.x, 1./ direction.y, 1./ direction.z);
         t_min = 0.0;
         t_max = std::numeric_limits<double>::max();
+        kz = std::fabs(dir.x) > std::fabs(dir.y) ? (std::fabs(dir.x) > std::fabs(dir.z) ? 0 : 2)
+                                                 : (std::fabs(dir.y) > std::fabs(dir.z) ? 1 : 2);
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        Sx = -float(dir[kx]) / float(dir[kz]);
+        Sy = -float(dir[ky]) / float(dir[kz]);
+        Sz = 1.0f / float(dir[kz]);
 
     }
 
@@ -7,6 +7,7 @@
 #include "Triangle.hpp"
 #include <cassert>
 #include <array>
+#include <map>
 
 /*
 **来自于job5的源码
@@ -31,6 +32,94 @@ bool rayTriangleIntersect(const Vector3f& v0, const Vector3f& v1,
     else    return false;
 }
 
+/*
+**Möller-Trumbore光线与三角形求交(剔除背面)
+**v0为顶点，e1 = v1 - v0，e2 = v2 - v0，N为面法向量；相交时返回true，t为光线参数，u、v为重心坐标
+*/
+inline bool intersectTriangleMT(const Vector3f& v0, const Vector3f& e1, const Vector3f& e2,
+                                const Vector3f& N, const Ray& ray, double& t, double& u, double& v)
+{
+    if (dotProduct(ray.direction, N) > 0)
+        return false;
+    Vector3f pvec = crossProduct(ray.direction, e2);
+    double det = dotProduct(e1, pvec);
+    if (fabs(det) < EPSILON)
+        return false;
+
+    double det_inv = 1. / det;
+    Vector3f tvec = ray.origin - v0;
+    u = dotProduct(tvec, pvec) * det_inv;
+    if (u < 0 || u > 1)
+        return false;
+    Vector3f qvec = crossProduct(tvec, e1);
+    v = dotProduct(ray.direction, qvec) * det_inv;
+    if (v < 0 || u + v > 1)
+        return false;
+    t = dotProduct(e2, qvec) * det_inv;
+    return t >= 0;
+}
+
+/*
+**单精度水密求交(Woop et al. 2013)：以光线起点为原点，置换坐标轴并剪切，使光线方向变为+z
+**之后只需判断三条边函数的符号；相邻三角形在共享边上算出的边函数互为相反数，光线不会从缝隙漏过
+**边函数恰为0时用double重算；与Möller-Trumbore一样只接受正面(det < 0)，并要求t > 0
+*/
+inline bool intersectTriangleWatertight(const Vector3f& v0, const Vector3f& v1, const Vector3f& v2,
+                                        const Ray& ray, double& t, double& u, double& v)
+{
+    const Vector3f a = v0 - ray.origin, b = v1 - ray.origin, c = v2 - ray.origin;
+    const float az = a[ray.kz], bz = b[ray.kz], cz = c[ray.kz];
+    const float ax = float(a[ray.kx]) + ray.Sx * az, ay = float(a[ray.ky]) + ray.Sy * az;
+    const float bx = float(b[ray.kx]) + ray.Sx * bz, by = float(b[ray.ky]) + ray.Sy * bz;
+    const float cx = float(c[ray.kx]) + ray.Sx * cz, cy = float(c[ray.ky]) + ray.Sy * cz;
+
+    float e0 = bx * cy - by * cx;
+    float e1 = cx * ay - cy * ax;
+    float e2 = ax * by - ay * bx;
+    if (e0 == 0.0f || e1 == 0.0f || e2 == 0.0f) {
+        e0 = float(double(bx) * cy - double(by) * cx);
+        e1 = float(double(cx) * ay - double(cy) * ax);
+        e2 = float(double(ax) * by - double(ay) * bx);
+    }
+    if (ray.Sz < 0.0f) {//剪切空间中det = dot(N, dir) / dir[kz]，统一成det < 0为正面
+        e0 = -e0;
+        e1 = -e1;
+        e2 = -e2;
+    }
+    if (e0 > 0.0f || e1 > 0.0f || e2 > 0.0f)//在三角形外或者是背面
+        return false;
+    const float det = e0 + e1 + e2;
+    if (det == 0.0f)
+        return false;
+    const float tScaled = ray.Sz * (e0 * az + e1 * bz + e2 * cz);
+    if (tScaled >= 0.0f)//det < 0，t <= 0
+        return false;
+
+    const float invDet = 1.0f / det;
+    t = tScaled * invDet;
+    u = e1 * invDet;
+    v = e2 * invDet;
+    return true;
+}
+
+enum class TriangleKernel { Watertight, MollerTrumbore };
+
+//三角形求交所用的算法，默认为水密求交；命令行参数--mt-kernel切换回Möller-Trumbore做A/B计时
+inline TriangleKernel triangleKernel = TriangleKernel::Watertight;
+
+/*
+**Triangle与MeshFace共用的三角形求交，按triangleKernel选择算法
+*/
+inline bool intersectTriangle(const Vector3f& v0, const Vector3f& v1, const Vector3f& v2,
+                              const Ray& ray, double& t)
+{
+    double u, v;
+    if (triangleKernel == TriangleKernel::Watertight)
+        return intersectTriangleWatertight(v0, v1, v2, ray, t, u, v);
+    Vector3f e1 = v1 - v0, e2 = v2 - v0;
+    return intersectTriangleMT(v0, e1, e2, crossProduct(e1, e2), ray, t, u, v);
+}
+
 class Triangle : public Object
 {
 public:
@@ -62,8 +151,37 @@ public:
     Bounds3 getBounds() override;
 };
 
+class MeshTriangle;
+
+/*
+**网格中的一个三角形面：只保存所属网格和面的序号，顶点、材质都从网格的共享数据中读取
+**作为网格内部BVH树的叶子使用
+*/
+class MeshFace : public Object
+{
+public:
+    MeshTriangle* mesh;//所属网格
+    uint32_t index;//面序号，顶点索引为mesh->vertexIndex[index * 3 + 0..2]
+
+    MeshFace(MeshTriangle* _mesh, uint32_t _index) : mesh(_mesh), index(_index) {}
+
+    bool intersect(const Ray& ray) override { return true; }
+    bool intersect(const Ray& ray, float& tnear, uint32_t& index) const override { return false; }
+    Intersection getIntersection(Ray ray) override;
+    void getSurfaceProperties(const Vector3f& P, const Vector3f& I,
+                              const uint32_t& index, const Vector2f& uv,
+                              Vector3f& N, Vector2f& st) const override;
+    Vector3f evalDiffuseColor(const Vector2f&) const override { return Vector3f(0.5, 0.5, 0.5); }
+    Bounds3 getBounds() override;
+
+    const Vector3f& v0() const;
+    const Vector3f& v1() const;
+    const Vector3f& v2() const;
+};
+
 /*
-**MeshTriangle类型用于
+**MeshTriangle类型用于存储索引三角形网格：共享顶点池vertices + 每个面3个32位索引vertexIndex + 整个网格共用一个材质m
+**OBJ_Loader为每个面单独展开顶点，构造时按(位置, 纹理坐标)合并相同的顶点
 */
 class MeshTriangle : public Object
 {
@@ -76,50 +194,53 @@ public:
         assert(loader.LoadedMeshes.size() == 1);
         auto mesh = loader.LoadedMeshes[0];
 
-        Vector3f min_vert = Vector3f{std::numeric_limits<float>::infinity(),
-                                     std::numeric_limits<float>::infinity(),
-                                     std::numeric_limits<float>::infinity()};
-        Vector3f max_vert = Vector3f{-std::numeric_limits<float>::infinity(),
-                                     -std::numeric_limits<float>::infinity(),
-                                     -std::numeric_limits<float>::infinity()};
-
-        for (int i = 0; i < mesh.Vertices.size(); i += 3) {
-            std::array<Vector3f, 3> face_vertices;
-            for (int j = 0; j < 3; j++) {//遍历三角形内的顶点
-                auto vert = Vector3f(mesh.Vertices[i + j].Position.X,
-                                     mesh.Vertices[i + j].Position.Y,
-                                     mesh.Vertices[i + j].Position.Z) *
-                            60.f;
-                face_vertices[j] = vert;
-
-                min_vert = Vector3f(std::min(min_vert.x, vert.x),
-                                    std::min(min_vert.y, vert.y),
-                                    std::min(min_vert.z, vert.z));
-                max_vert = Vector3f(std::max(max_vert.x, vert.x),
-                                    std::max(max_vert.y, vert.y),
-                                    std::max(max_vert.z, vert.z));
-            }
-
-            auto new_mat =
-                new Material(MaterialType::DIFFUSE_AND_GLOSSY,
-                             Vector3f(0.5, 0.5, 0.5), Vector3f(0, 0, 0));
-            new_mat->Kd = 0.6;
-            new_mat->Ks = 0.0;
-            new_mat->specularExponent = 0;
+        std::map<std::array<float, 5>, uint32_t> unique;//(位置, 纹理坐标) -> 顶点池中的序号
+        std::vector<uint32_t> indices;
+        indices.reserve(mesh.Vertices.size());
+        for (auto& vert : mesh.Vertices) {
+            std::array<float, 5> key = {vert.Position.X, vert.Position.Y, vert.Position.Z,
+                                        vert.TextureCoordinate.X, vert.TextureCoordinate.Y};
+            auto it = unique.emplace(key, (uint32_t)unique.size()).first;
+            indices.push_back(it->second);
+        }
 
-            triangles.emplace_back(face_vertices[0], face_vertices[1],
-                                   face_vertices[2], new_mat);
+        numVertices = unique.size();
+        numTriangles = indices.size() / 3;
+        vertices.reset(new Vector3f[numVertices]);
+        stCoordinates.reset(new Vector2f[numVertices]);
+        vertexIndex.reset(new uint32_t[numTriangles * 3]);
+        for (auto& [key, i] : unique) {
+            vertices[i] = Vector3f(key[0], key[1], key[2]) * 60.f;
+            stCoordinates[i] = Vector2f(key[3], key[4]);
         }
+        std::copy(indices.begin(), indices.begin() + numTriangles * 3, vertexIndex.get());
+
+        bounding_box = Bounds3();
+        for (uint32_t i = 0; i < numVertices; ++i)
+            bounding_box = Union(bounding_box, vertices[i]);
 
-        bounding_box = Bounds3(min_vert, max_vert);
+        //整个网格共用一个材质
+        m = new Material(MaterialType::DIFFUSE_AND_GLOSSY,
+                         Vector3f(0.5, 0.5, 0.5), Vector3f(0, 0, 0));
+        m->Kd = 0.6;
+        m->Ks = 0.0;
+        m->specularExponent = 0;
+
+        faces.reserve(numTriangles);
+        for (uint32_t k = 0; k < numTriangles; ++k)
+            faces.emplace_back(this, k);
 
         std::vector<Object*> ptrs;
-        for (auto& tri : triangles)
-            ptrs.push_back(&tri);
+        for (auto& face : faces)
+            ptrs.push_back(&face);
 
         bvh = new BVHAccel(ptrs);
     }
 
+    //faces中保存了指向本网格的指针，不允许拷贝或移动
+    MeshTriangle(const MeshTriangle&) = delete;
+    MeshTriangle& operator=(const MeshTriangle&) = delete;
+
     bool intersect(const Ray& ray) { return true; }
 
     bool intersect(const Ray& ray, float& tnear, uint32_t& index) const
@@ -181,18 +302,49 @@ public:
     }
 
     Bounds3 bounding_box;
-    std::unique_ptr<Vector3f[]> vertices;
+    std::unique_ptr<Vector3f[]> vertices;//共享顶点池
+    uint32_t numVertices;
     uint32_t numTriangles;
-    std::unique_ptr<uint32_t[]> vertexIndex;
-    std::unique_ptr<Vector2f[]> stCoordinates;
+    std::unique_ptr<uint32_t[]> vertexIndex;//每个面3个顶点索引
+    std::unique_ptr<Vector2f[]> stCoordinates;//与顶点池一一对应的纹理坐标
 
-    std::vector<Triangle> triangles;
+    std::vector<MeshFace> faces;//BVH树的叶子
 
     BVHAccel* bvh;
 
     Material* m;
 };
 
+inline const Vector3f& MeshFace::v0() const { return mesh->vertices[mesh->vertexIndex[index * 3]]; }
+inline const Vector3f& MeshFace::v1() const { return mesh->vertices[mesh->vertexIndex[index * 3 + 1]]; }
+inline const Vector3f& MeshFace::v2() const { return mesh->vertices[mesh->vertexIndex[index * 3 + 2]]; }
+
+inline Bounds3 MeshFace::getBounds() { return Union(Bounds3(v0(), v1()), v2()); }
+
+inline void MeshFace::getSurfaceProperties(const Vector3f& P, const Vector3f& I,
+                                           const uint32_t&, const Vector2f& uv,
+                                           Vector3f& N, Vector2f& st) const
+{
+    N = normalize(crossProduct(v1() - v0(), v2() - v0()));
+}
+
+inline Intersection MeshFace::getIntersection(Ray ray)
+{
+    Intersection inter;
+    double t;
+    if (!intersectTriangle(v0(), v1(), v2(), ray, t))
+        return inter;
+
+    inter.distance = t;
+    inter.obj = this;
+    inter.happened = true;
+    inter.normal = normalize(crossProduct(v1() - v0(), v2() - v0()));
+    inter.m = mesh->m;
+    inter.coords = ray(t);
+    return inter;
+}
+
+
 inline bool Triangle::intersect(const Ray& ray) { return true; }
 inline bool Triangle::intersect(const Ray& ray, float& tnear,
                                 uint32_t& index) const
@@ -205,29 +357,10 @@ inline Bounds3 Triangle::getBounds() { return Union(Bounds3(v0, v1), v2); }
 inline Intersection Triangle::getIntersection(Ray ray)
 {
     Intersection inter;
+    double t_tmp;
+    if (!intersectTriangle(v0, v1, v2, ray, t_tmp))
+        return inter; // no intersection
 
-    if (dotProduct(ray.direction, normal) > 0)
-        return inter;
-    double u, v, t_tmp = 0;
-    Vector3f pvec = crossProduct(ray.direction, e2);
-    double det = dotProduct(e1, pvec);
-    if (fabs(det) < EPSILON)
-        return inter;
-
-    double det_inv = 1. / det;
-    Vector3f tvec = ray.origin - v0;
-    u = dotProduct(tvec, pvec) * det_inv;
-    if (u < 0 || u > 1)
-        return inter;
-    Vector3f qvec = crossProduct(tvec, e1);
-    v = dotProduct(ray.direction, qvec) * det_inv;
-    if (v < 0 || u + v > 1)
-        return inter;
-    t_tmp = dotProduct(e2, qvec) * det_inv;
-
-    // TODO find ray triangle intersection
-    
-    if (t_tmp<0)    return inter; // no intersection
     // intersection--assgin other information
     inter.distance = t_tmp; // time needed to intersect
     inter.obj=this;
@@ -4,6 +4,7 @@
 #include "Vector.hpp"
 #include "global.hpp"
 #include <chrono>
+#include <cstring>
 
 // In the main function of the program, we create the scene (create objects and
 // lights) as well as set the options for the render (image width and height,
@@ -13,6 +14,10 @@ int main(int argc, char** argv)
 {
     Scene scene(1280, 960);
 
+    //--mt-kernel：用原先的Möller-Trumbore求交代替水密求交，用于对比耗时
+    if (argc > 1 && strcmp(argv[1], "--mt-kernel") == 0)
+        triangleKernel = TriangleKernel::MollerTrumbore;
+
     MeshTriangle bunny("../models/bunny/bunny.obj");
 
     scene.Add(&bunny);
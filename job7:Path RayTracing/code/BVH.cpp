@@ -1,13 +1,16 @@
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cmath>
 #include "BVH.hpp"
+#include "ThreadPool.hpp"
 
 /*
 **有参构造函数
 **输入形参：p包含所有物体，maxPrimsInNode表示单个BVH树node能容纳的最多物体数量，splitMethod表示切分方法
 */
-BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode, SplitMethod splitMethod)
-    : maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod), primitives(std::move(p))
+BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode, SplitMethod splitMethod, int lazyDepth)
+    : maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod), lazyDepth(lazyDepth), primitives(std::move(p))
 {
     time_t start, stop;//开始时间、停止时间
 
@@ -16,6 +19,7 @@ BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode, SplitMethod split
         return ;
 
     root = recursiveBuild(primitives);//当数据成员primitives内有物体时，返回建立的BVH树根节点
+    buildCost = SAHCost();
 
     time(&stop);//stop被给定为当前时间
 
@@ -37,8 +41,9 @@ BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode, SplitMethod split
 **3.为两个物体子集重新构建包围盒
 **4.知道物体子集中的物体数达到某个要求时，停止递归，不再划分物体子集
 **5.在叶子节点中存储所有的物体(非叶子节点不存储物体)
+**延迟构建时，深度达到lazyDepth的子树只计算包围盒，物体暂存在旁表中等待expand
 */
-BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
+BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects, int depth) const
 {
     // Bounds3 bounds;    //建立根包围盒，以容纳所有物体
     // for (int i = 0; i < objects.size(); ++i)//遍历objects中的所有object
@@ -53,6 +58,7 @@ BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
         node->left = nullptr;//无孩子节点
         node->right = nullptr;
         node->area = objects[0]->getArea();
+        node->nPrimitives = 1;
         return node;
     }
     else if (objects.size() == 2) {//objects中的object总数为2
@@ -61,6 +67,21 @@ BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
         node->right = recursiveBuild(std::vector{objects[1]});
         node->bounds = Union(node->left->bounds, node->right->bounds);//更新更节点对应的包围盒(根节点的object数据成员为nullptr)
         node->area = node->left->area + node->right->area;
+        node->nPrimitives = 2;
+        return node;
+    }
+
+    else if (lazyDepth > 0 && depth >= lazyDepth) {//延迟构建：只需O(n)地计算包围盒与面积
+        node->area = 0;
+        for (auto object : objects) {
+            node->bounds = Union(node->bounds, object->getBounds());
+            node->area += object->getArea();
+        }
+        node->nPrimitives = objects.size();
+        auto entry = std::make_unique<DeferredSubtree>();
+        entry->objects = std::move(objects);
+        std::unique_lock<std::shared_mutex> lock(deferredMutex);
+        deferredNodes[node] = std::move(entry);
         return node;
     }
 
@@ -100,60 +121,116 @@ BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
 
         assert(objects.size() == (leftshapes.size() + rightshapes.size()));//断言是否少划分了物体
 
-        node->left = recursiveBuild(leftshapes);//递归构建左子树，参数是物体集(objects)
-        node->right = recursiveBuild(rightshapes);//递归构建右子树
+        node->left = recursiveBuild(leftshapes, depth + 1);//递归构建左子树，参数是物体集(objects)
+        node->right = recursiveBuild(rightshapes, depth + 1);//递归构建右子树
         node->bounds = Union(node->left->bounds, node->right->bounds);//更新node->bounds，以容纳左、右子树的全部包围盒
         node->area = node->left->area + node->right->area;//更新node->area，以容纳左、右子树的全部area
+        node->nPrimitives = node->left->nPrimitives + node->right->nPrimitives;
     }
     return node;
 } 
 
+Bounds3 BVHAccel::WorldBound() const
+{
+    return root ? root->bounds : Bounds3();
+}
+
+BVHAccel::~BVHAccel()
+{
+    freeNode(root);
+}
+
 /*
 **给定光线ray，如果其与BVH树有交点，返回相交数据
+**遍历时只维护轻量的Hit，完整的相交数据只为最终的最近交点计算一次
 */
 Intersection BVHAccel::Intersect(const Ray& ray) const
 {
-    Intersection isect;
-    if (!root)  return isect;
-    isect = BVHAccel::getIntersection(root, ray);
-    return isect;
+    Hit hit;
+    if (!IntersectHit(ray, hit)) return Intersection();
+    return hit.obj->getSurfaceInteraction(ray, hit);
 }
 
-/*
-**判断ray与BVH树是否相交，返回相交数据
-*/
-Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const
+bool BVHAccel::IntersectHit(const Ray& ray, Hit& hit) const
 {
-    Intersection inter;//存储相交数据
+    if (!root)  return false;
+    if (useCompressed) return getCompressedIntersection(ray, hit);
+
     Vector3f indiv(1.0f/ray.direction[0], 1.0f/ray.direction[1], 1.0f/ray.direction[2]);//用乘法代替除法以加速运算：此为光线的法向量各坐标值的倒数组成的向量，用于除以法向量的情况
     std::array<int, 3> dirIsNeg;
-    
     //如果给定光线的方向某条轴上坐标为正，则 dirIsNeg[]值为1
     dirIsNeg[0] = int(ray.direction.x > 0);
     dirIsNeg[1] = int(ray.direction.y > 0);
     dirIsNeg[2] = int(ray.direction.z > 0);
+    return getIntersection(root, ray, indiv, dirIsNeg, hit);
+}
 
-    //如果给定光线与BVH树node所存储的包围盒不相交，返回Intersection默认结构
-    if (!node->bounds.IntersectP(ray, indiv, dirIsNeg))    return inter;
+/*
+**判断ray与BVH树node是否相交，有更近的命中时更新hit
+*/
+bool BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray, const Vector3f& invDir,
+                               const std::array<int, 3>& dirIsNeg, Hit& hit) const
+{
+    //如果给定光线与BVH树node所存储的包围盒不相交，直接返回
+    if (!node->bounds.IntersectP(ray, invDir, dirIsNeg))    return false;
 
     //前提：给定光线与BVH树node所存储的包围盒相交
     //如果node是叶子节点，需要继续判断光线是否与叶子节点内的物体是否相交
-    if (node->left==nullptr && node->right==nullptr)
-    {
-        inter=node->object->getIntersection(ray);//判断光线与该物体是否相交，并存储相交数据(要去看各object类型的实现函数)
-        return inter;//返回相交数据
+    if (node->left==nullptr && node->right==nullptr) {
+        if (node->object) return node->object->intersectHit(ray, hit);
+        node = expand(node);//没有物体的叶子是延迟构建的子树，光线第一次进入时才构建它
+    }
+
+    //与包围盒相交，但node不是叶子节点时，要递归判断光线与node的左右子树是否相交，hit中始终保留距离最近的命中
+    bool left = getIntersection(node->left, ray, invDir, dirIsNeg, hit);
+    bool right = getIntersection(node->right, ray, invDir, dirIsNeg, hit);
+    return left || right;
+}
+
+bool BVHAccel::IntersectP(const Ray& ray) const
+{
+    return IntersectP(ray, (float)std::min(ray.t_max, (double)std::numeric_limits<float>::max()));
+}
+
+bool BVHAccel::IntersectP(const Ray& ray, float tMax) const
+{
+    if (!root)  return false;
+    if (useCompressed) {
+        Hit hit;
+        hit.t = tMax;
+        return getCompressedIntersection(ray, hit, true);
     }
-    
-    //与包围盒相交，但node不是叶子节点时，要递归判断光线与node的左右子树是否相交
-    Intersection left = getIntersection(node->left, ray);
-    Intersection right = getIntersection(node->right, ray);
-    return left.distance<right.distance ? left : right;//返回距离最近的相交点的相交数据(未考虑光线的递归反射、递归折射)
+
+    Vector3f indiv(1.0f/ray.direction[0], 1.0f/ray.direction[1], 1.0f/ray.direction[2]);
+    std::array<int, 3> dirIsNeg;
+    dirIsNeg[0] = int(ray.direction.x > 0);
+    dirIsNeg[1] = int(ray.direction.y > 0);
+    dirIsNeg[2] = int(ray.direction.z > 0);
+    return getOcclusion(root, ray, indiv, dirIsNeg, tMax);
+}
+
+/*
+**与getIntersection相同，但任一叶子命中后立即返回，不再访问剩余的子树
+*/
+bool BVHAccel::getOcclusion(BVHBuildNode* node, const Ray& ray, const Vector3f& invDir,
+                            const std::array<int, 3>& dirIsNeg, float tMax) const
+{
+    if (!node->bounds.IntersectP(ray, invDir, dirIsNeg))    return false;
+
+    if (node->left==nullptr && node->right==nullptr) {
+        if (node->object) return node->object->intersectAny(ray, tMax);
+        node = expand(node);
+    }
+
+    return getOcclusion(node->left, ray, invDir, dirIsNeg, tMax) ||
+           getOcclusion(node->right, ray, invDir, dirIsNeg, tMax);
 }
 
 /*
 **
 */
 void BVHAccel::getSample(BVHBuildNode* node, float p, Intersection &pos, float &pdf){
+    node = expand(node);
     if(node->left == nullptr || node->right == nullptr){//当node不同时含有左子树盒右子树时
         node->object->Sample(pos, pdf);//对node内的object采样
         pdf *= node->area;//用node的总包围盒面积乘以pdf
@@ -172,4 +249,545 @@ void BVHAccel::Sample(Intersection &pos, float &pdf){
     float p = std::sqrt(get_random_float()) * root->area;
     getSample(root, p, pos, pdf);
     pdf /= root->area;
-}
\ No newline at end of file
+}
+
+/*
+**展开延迟构建的节点：继续向下构建lazyDepth层，得到的子树保存在旁表中，node本身不被修改
+**std::call_once保证多个渲染线程同时进入时只构建一次，其余线程等待构建完成
+*/
+BVHBuildNode* BVHAccel::expand(BVHBuildNode* node) const
+{
+    DeferredSubtree* entry = deferredOf(node);
+    if (!entry) return node;
+    std::call_once(entry->built, [this, entry] {
+        entry->root = recursiveBuild(std::move(entry->objects), 0);
+        entry->objects = std::vector<Object*>();
+    });
+    return entry->root;
+}
+
+BVHAccel::DeferredSubtree* BVHAccel::deferredOf(const BVHBuildNode* node) const
+{
+    if (node->left || node->right || node->object) return nullptr;
+    std::shared_lock<std::shared_mutex> lock(deferredMutex);
+    auto it = deferredNodes.find(node);
+    return it == deferredNodes.end() ? nullptr : it->second.get();
+}
+
+void BVHAccel::graft(BVHBuildNode* node)
+{
+    if (!deferredOf(node)) return;
+    BVHBuildNode* sub = expand(node);
+    node->left = sub->left;
+    node->right = sub->right;
+    node->object = sub->object;
+    delete sub;
+    std::unique_lock<std::shared_mutex> lock(deferredMutex);
+    deferredNodes.erase(node);
+}
+
+//子树内物体数不超过该值时，插入物体直接重建整棵子树
+static constexpr int kLocalRebuildSize = 8;
+
+/*
+**物体顶点或变换更新后调用：树结构不变，自底向上重新计算每个节点的包围盒与面积
+**SAH质量退化超过rebuildThreshold时自动整体重建
+*/
+void BVHAccel::refit()
+{
+    if (!root) return;
+    refitNode(root);
+    checkQuality();
+    updateCompressed();
+}
+
+void BVHAccel::refitNode(BVHBuildNode* node)
+{
+    if (DeferredSubtree* entry = deferredOf(node)) {
+        if (entry->root) {//已构建的子树：refit后把结果同步到延迟节点上
+            refitNode(entry->root);
+            node->bounds = entry->root->bounds;
+            node->area = entry->root->area;
+            return;
+        }
+        node->bounds = Bounds3();//未展开的子树不必构建，直接按物体重算包围盒
+        node->area = 0;
+        for (auto object : entry->objects) {
+            node->bounds = Union(node->bounds, object->getBounds());
+            node->area += object->getArea();
+        }
+        return;
+    }
+    if (node->left == nullptr && node->right == nullptr) {//叶子节点：直接取物体的最新包围盒
+        node->bounds = node->object->getBounds();
+        node->area = node->object->getArea();
+        return;
+    }
+    refitNode(node->left);
+    refitNode(node->right);
+    node->bounds = Union(node->left->bounds, node->right->bounds);
+    node->area = node->left->area + node->right->area;
+}
+
+/*
+**插入一个顶层物体：沿表面积增量最小的孩子向下，到达较小的子树后只重建该子树
+*/
+void BVHAccel::insert(Object* object)
+{
+    primitives.push_back(object);
+    root = root ? insertNode(root, object) : recursiveBuild(std::vector{object});
+    checkQuality();
+    updateCompressed();
+}
+
+BVHBuildNode* BVHAccel::insertNode(BVHBuildNode* node, Object* object)
+{
+    if (node->nPrimitives <= kLocalRebuildSize) {//局部重建
+        std::vector<Object*> objects;
+        collectObjects(node, objects);
+        objects.push_back(object);
+        freeNode(node);
+        return recursiveBuild(objects);
+    }
+
+    if (DeferredSubtree* entry = deferredOf(node); entry && !entry->root) {//未展开的延迟节点：物体加入待构建列表即可，不必构建子树
+        entry->objects.push_back(object);
+        node->bounds = Union(node->bounds, object->getBounds());
+        node->area += object->getArea();
+        node->nPrimitives = entry->objects.size();
+        return node;
+    }
+    graft(node);
+    Bounds3 b = object->getBounds();
+    double growLeft = Union(node->left->bounds, b).SurfaceArea() - node->left->bounds.SurfaceArea();
+    double growRight = Union(node->right->bounds, b).SurfaceArea() - node->right->bounds.SurfaceArea();
+    if (growLeft <= growRight)
+        node->left = insertNode(node->left, object);
+    else
+        node->right = insertNode(node->right, object);
+
+    node->bounds = Union(node->left->bounds, node->right->bounds);
+    node->area = node->left->area + node->right->area;
+    node->nPrimitives = node->left->nPrimitives + node->right->nPrimitives;
+    return node;
+}
+
+/*
+**删除一个顶层物体：叶子被删除后，由其兄弟子树顶替父节点，再沿路径更新包围盒
+**物体可能已经移动过，所以这里不按包围盒剪枝；未展开的延迟节点只查找其物体列表，不会被构建
+*/
+bool BVHAccel::remove(Object* object)
+{
+    auto it = std::find(primitives.begin(), primitives.end(), object);
+    if (it == primitives.end()) return false;
+    primitives.erase(it);
+
+    bool found = false;
+    root = removeNode(root, object, found);
+    checkQuality();
+    updateCompressed();
+    return found;
+}
+
+BVHBuildNode* BVHAccel::removeNode(BVHBuildNode* node, Object* object, bool &found)
+{
+    if (DeferredSubtree* entry = deferredOf(node); entry && !entry->root) {
+        auto it = std::find(entry->objects.begin(), entry->objects.end(), object);
+        if (it == entry->objects.end()) return node;
+        found = true;
+        entry->objects.erase(it);
+        if (entry->objects.empty()) {
+            {
+                std::unique_lock<std::shared_mutex> lock(deferredMutex);
+                deferredNodes.erase(node);
+            }
+            delete node;
+            return nullptr;
+        }
+        node->bounds = Bounds3();
+        node->area = 0;
+        for (auto o : entry->objects) {
+            node->bounds = Union(node->bounds, o->getBounds());
+            node->area += o->getArea();
+        }
+        node->nPrimitives = entry->objects.size();
+        return node;
+    }
+    graft(node);
+    if (node->left == nullptr && node->right == nullptr) {
+        if (node->object != object) return node;
+        found = true;
+        delete node;
+        return nullptr;
+    }
+
+    node->left = removeNode(node->left, object, found);
+    if (!found) node->right = removeNode(node->right, object, found);
+    if (!found) return node;
+
+    BVHBuildNode* only = node->left ? (node->right ? nullptr : node->left) : node->right;
+    if (only) {//某个孩子被删空，用另一个孩子替换当前节点
+        delete node;
+        return only;
+    }
+    node->bounds = Union(node->left->bounds, node->right->bounds);
+    node->area = node->left->area + node->right->area;
+    node->nPrimitives = node->left->nPrimitives + node->right->nPrimitives;
+    return node;
+}
+
+/*
+**丢弃当前树，对primitives完整重建
+*/
+void BVHAccel::rebuild()
+{
+    freeNode(root);
+    root = primitives.empty() ? nullptr : recursiveBuild(primitives);
+    buildCost = SAHCost();
+}
+
+void BVHAccel::checkQuality()
+{
+    if (root && SAHCost() > rebuildThreshold * buildCost) {
+        printf(" - BVH quality degraded (SAH %.2f -> %.2f), rebuilding...\n", buildCost, SAHCost());
+        rebuild();
+    }
+}
+
+/*
+**SAH代价：各节点包围盒表面积相对根节点的比例，内部节点计一次遍历代价，叶子节点计一次物体求交代价
+*/
+float BVHAccel::SAHCost() const
+{
+    if (!root) return 0;
+    double rootArea = root->bounds.SurfaceArea();
+    if (rootArea <= 0) return 0;
+    return nodeCost(root) / rootArea;
+}
+
+float BVHAccel::nodeCost(BVHBuildNode* node) const
+{
+    if (DeferredSubtree* entry = deferredOf(node); entry && entry->root) node = entry->root;//未构建的延迟节点按叶子计
+    double area = node->bounds.SurfaceArea();
+    if (node->left == nullptr && node->right == nullptr)
+        return area * node->nPrimitives;
+    return area + nodeCost(node->left) + nodeCost(node->right);
+}
+
+void BVHAccel::collectObjects(BVHBuildNode* node, std::vector<Object*> &objects) const
+{
+    if (DeferredSubtree* entry = deferredOf(node)) {
+        if (entry->root) collectObjects(entry->root, objects);
+        else objects.insert(objects.end(), entry->objects.begin(), entry->objects.end());
+        return;
+    }
+    if (node->left == nullptr && node->right == nullptr) {
+        objects.push_back(node->object);
+        return;
+    }
+    collectObjects(node->left, objects);
+    collectObjects(node->right, objects);
+}
+
+void BVHAccel::freeNode(BVHBuildNode* node)
+{
+    if (!node) return;
+    if (DeferredSubtree* entry = deferredOf(node)) {
+        BVHBuildNode* sub = entry->root;
+        {
+            std::unique_lock<std::shared_mutex> lock(deferredMutex);
+            deferredNodes.erase(node);
+        }
+        freeNode(sub);
+    }
+    freeNode(node->left);
+    freeNode(node->right);
+    delete node;
+}
+
+/*
+**树旋转优化(Kensler 2008)：在节点内用孩子与孙子交换位置，若被改动孩子的包围盒表面积变小则SAH代价下降
+**顶部若干层以下的子树互不相交，由共享线程池并行优化；到达时间预算或不再有改进时停止
+**返回优化后的SAH代价
+*/
+float BVHAccel::optimize(double timeBudget)
+{
+    if (!root) return 0;
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(timeBudget));
+    float before = SAHCost();
+
+    ThreadPool& pool = ThreadPool::shared();
+    int threads = pool.size() + 1;//工作线程和调用线程
+    int splitDepth = (int)std::ceil(std::log2((double)threads)) + 2;//每个线程约分到4棵子树
+
+    int passes = 0;
+    while (std::chrono::steady_clock::now() < deadline) {
+        //rotateTop会旋转第splitDepth-1层的节点，使上一遍的子树根移到另一棵子树之下，所以每一遍都重新收集
+        std::vector<BVHBuildNode*> subtrees;
+        collectSubtrees(root, 0, splitDepth, subtrees);
+        std::atomic<int> subtreeRotations{0};
+        pool.parallelFor(subtrees.size(), 1, [&](size_t begin, size_t end) {
+            for (size_t k = begin; k < end; ++k) subtreeRotations += rotateSubtree(subtrees[k], deadline);
+        });
+        int rotations = subtreeRotations;
+        rotations += rotateTop(root, 0, splitDepth);//子树之上的顶部节点串行优化
+        ++passes;
+        if (rotations == 0) break;
+    }
+
+    updateCompressed();
+    float after = SAHCost();
+    printf(" - BVH optimization: SAH cost %.3f -> %.3f (%d passes)\n", before, after, passes);
+    return after;
+}
+
+void BVHAccel::collectSubtrees(BVHBuildNode* node, int depth, int splitDepth, std::vector<BVHBuildNode*> &subtrees)
+{
+    if (node->left == nullptr && node->right == nullptr) return;//顶部的叶子没有可旋转的结构
+    if (depth == splitDepth) {
+        subtrees.push_back(node);
+        return;
+    }
+    collectSubtrees(node->left, depth + 1, splitDepth, subtrees);
+    collectSubtrees(node->right, depth + 1, splitDepth, subtrees);
+}
+
+//后序遍历，先优化孩子再优化当前节点，使孩子的包围盒在当前节点比较前已经是最新的
+int BVHAccel::rotateSubtree(BVHBuildNode* node, std::chrono::steady_clock::time_point deadline)
+{
+    if (node->left == nullptr && node->right == nullptr) return 0;
+    if (std::chrono::steady_clock::now() >= deadline) return 0;
+    int rotations = rotateSubtree(node->left, deadline) + rotateSubtree(node->right, deadline);
+    return rotations + rotate(node);
+}
+
+int BVHAccel::rotateTop(BVHBuildNode* node, int depth, int splitDepth)
+{
+    if (depth >= splitDepth || (node->left == nullptr && node->right == nullptr)) return 0;
+    int rotations = rotateTop(node->left, depth + 1, splitDepth) + rotateTop(node->right, depth + 1, splitDepth);
+    return rotations + rotate(node);
+}
+
+/*
+**尝试node上的四种旋转：左孩子与右孩子的某个孩子交换，或右孩子与左孩子的某个孩子交换
+**node自身的包围盒不变，只有被交换进去的那个孩子的包围盒变化，选择表面积下降最多的一种
+*/
+bool BVHAccel::rotate(BVHBuildNode* node)
+{
+    auto isLeaf = [](BVHBuildNode* n) { return n->left == nullptr && n->right == nullptr; };
+    BVHBuildNode *l = node->left, *r = node->right;
+
+    double best = 0;
+    int choice = -1;
+    if (!isLeaf(r)) {
+        double sa = r->bounds.SurfaceArea();
+        double d0 = Union(l->bounds, r->right->bounds).SurfaceArea() - sa;//l <-> r->left
+        double d1 = Union(r->left->bounds, l->bounds).SurfaceArea() - sa;//l <-> r->right
+        if (d0 < best) { best = d0; choice = 0; }
+        if (d1 < best) { best = d1; choice = 1; }
+    }
+    if (!isLeaf(l)) {
+        double sa = l->bounds.SurfaceArea();
+        double d2 = Union(r->bounds, l->right->bounds).SurfaceArea() - sa;//r <-> l->left
+        double d3 = Union(l->left->bounds, r->bounds).SurfaceArea() - sa;//r <-> l->right
+        if (d2 < best) { best = d2; choice = 2; }
+        if (d3 < best) { best = d3; choice = 3; }
+    }
+    //忽略数值误差级别的改进，避免来回旋转
+    if (choice < 0 || best > -1e-6 * node->bounds.SurfaceArea()) return false;
+
+    BVHBuildNode* changed;
+    switch (choice) {
+    case 0: std::swap(node->left, r->left); changed = r; break;
+    case 1: std::swap(node->left, r->right); changed = r; break;
+    case 2: std::swap(node->right, l->left); changed = l; break;
+    default: std::swap(node->right, l->right); changed = l; break;
+    }
+    changed->bounds = Union(changed->left->bounds, changed->right->bounds);
+    changed->area = changed->left->area + changed->right->area;
+    changed->nPrimitives = changed->left->nPrimitives + changed->right->nPrimitives;
+    return true;
+}
+
+/*
+**把二叉树收拢成4叉树：反复打开表面积最大的内部孩子，直到凑满4个孩子
+**孩子包围盒相对父节点量化到[0,255]，min向下取整、max向上取整，反量化后的包围盒总是包含原包围盒
+*/
+void BVHAccel::compress()
+{
+    useCompressed = buildCompressed();
+    if (!useCompressed) {
+        if (root) printf(" - BVH too deep to compress, keeping the reference traversal\n");
+        return;
+    }
+
+    size_t buildNodes = 0;
+    std::vector<BVHBuildNode*> stack{root};
+    while (!stack.empty()) {
+        BVHBuildNode* node = expand(stack.back());
+        stack.pop_back();
+        ++buildNodes;
+        if (node->left) stack.push_back(node->left);
+        if (node->right) stack.push_back(node->right);
+    }
+    //BVHBuildNode树并没有释放，这里比较的是遍历时访问的数据量
+    size_t before = buildNodes * sizeof(BVHBuildNode);
+    size_t after = compressedNodes.size() * sizeof(CompressedBVHNode) + compressedPrims.size() * sizeof(Object*);
+    printf(" - BVH compressed: %zu nodes, traversal data %.1f KB -> %.1f KB (%.1f%%), build tree kept for updates\n",
+           compressedNodes.size(), before / 1024.0, after / 1024.0, 100.0 * after / before);
+}
+
+void BVHAccel::updateCompressed()
+{
+    if (useCompressed) useCompressed = buildCompressed();
+}
+
+//由当前的BVHBuildNode树重新生成压缩节点；树太深、遍历栈放不下时清空并返回false
+bool BVHAccel::buildCompressed()
+{
+    compressedNodes.clear();
+    compressedPrims.clear();
+    if (!root) return false;
+    int maxDepth = 0;
+    compressNode(root, 1, maxDepth);
+    //每弹出一个节点最多压入4个孩子，栈中最多3 * 层数 + 1项
+    if (3 * maxDepth + 1 <= kCompressedStackSize) return true;
+    compressedNodes.clear();
+    compressedPrims.clear();
+    return false;
+}
+
+uint32_t BVHAccel::compressNode(BVHBuildNode* node, int depth, int &maxDepth)
+{
+    maxDepth = std::max(maxDepth, depth);
+    auto isLeaf = [](BVHBuildNode* n) { return n->left == nullptr && n->right == nullptr; };
+    node = expand(node);
+
+    uint32_t index = compressedNodes.size();
+    compressedNodes.emplace_back();
+
+    //收集最多4个孩子
+    std::vector<BVHBuildNode*> children;
+    if (isLeaf(node)) children.push_back(node);
+    else children = {expand(node->left), expand(node->right)};//孩子加入时就展开延迟节点，保证叶子都带有物体
+    while (children.size() < 4) {
+        int widest = -1;
+        for (int i = 0; i < (int)children.size(); ++i) {
+            if (!isLeaf(children[i]) && (widest < 0 || children[i]->bounds.SurfaceArea() > children[widest]->bounds.SurfaceArea()))
+                widest = i;
+        }
+        if (widest < 0) break;
+        BVHBuildNode* open = children[widest];
+        children[widest] = expand(open->left);
+        children.push_back(expand(open->right));
+    }
+
+    //父节点坐标系：所有孩子包围盒的并集
+    Bounds3 frame;
+    for (auto child : children) frame = Union(frame, child->bounds);
+    const Vector3f &fMin = frame.pMin, &fMax = frame.pMax;
+    CompressedBVHNode qnode;
+    for (int a = 0; a < 3; ++a) {
+        float lo = fMin[a], extent = fMax[a] - lo;
+        qnode.origin[a] = lo;
+        //略微放大步长，保证origin + 255 * scale不小于父节点上界
+        qnode.scale[a] = extent > 0 ? extent / 255.0f * (1.0f + 1e-5f) : 0.0f;
+    }
+
+    for (int i = 0; i < 4; ++i) {
+        if (i >= (int)children.size()) {
+            qnode.child[i] = CompressedBVHNode::kEmptyChild;
+            for (int a = 0; a < 3; ++a) { qnode.qmin[a][i] = 255; qnode.qmax[a][i] = 0; }
+            continue;
+        }
+        const Bounds3& b = children[i]->bounds;
+        for (int a = 0; a < 3; ++a) {
+            float o = qnode.origin[a], sc = qnode.scale[a];
+            int lo = 0, hi = 255;
+            if (sc > 0) {
+                lo = std::clamp((int)std::floor((b.pMin[a] - o) / sc), 0, 255);
+                hi = std::clamp((int)std::ceil((b.pMax[a] - o) / sc), 0, 255);
+                while (lo > 0 && o + lo * sc > b.pMin[a]) --lo;//浮点误差修正，保证保守
+                while (hi < 255 && o + hi * sc < b.pMax[a]) ++hi;
+            }
+            qnode.qmin[a][i] = (uint8_t)lo;
+            qnode.qmax[a][i] = (uint8_t)hi;
+        }
+        if (isLeaf(children[i])) {
+            qnode.child[i] = CompressedBVHNode::kLeafFlag | (uint32_t)compressedPrims.size();
+            compressedPrims.push_back(children[i]->object);
+        }
+        else {
+            qnode.child[i] = CompressedBVHNode::kEmptyChild;//先占位，子节点序号在递归后填入
+        }
+    }
+    compressedNodes[index] = qnode;
+
+    for (int i = 0; i < (int)children.size(); ++i) {
+        if (!isLeaf(children[i])) {
+            uint32_t c = compressNode(children[i], depth + 1, maxDepth);
+            compressedNodes[index].child[i] = c;
+        }
+    }
+    return index;
+}
+
+/*
+**压缩节点的遍历：显式栈，就近优先，用当前最近交点剪枝
+**anyHit为true时用于阴影光线：叶子用intersectAny求交，任一交点的t小于hit.t即返回true(与getOcclusion相同)
+*/
+bool BVHAccel::getCompressedIntersection(const Ray& ray, Hit& hit, bool anyHit) const
+{
+    if (compressedNodes.empty()) return false;
+    bool found = false;
+
+    float invDir[3] = {(float)ray.direction_inv.x, (float)ray.direction_inv.y, (float)ray.direction_inv.z};
+    float orig[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+    bool neg[3] = {ray.direction.x < 0, ray.direction.y < 0, ray.direction.z < 0};
+
+    uint32_t stack[kCompressedStackSize];//compress保证3 * 层数 + 1不超过栈深度
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const CompressedBVHNode& node = compressedNodes[stack[--top]];
+        float tEnter[4];
+        int order[4], hits = 0;
+        for (int i = 0; i < 4; ++i) {
+            if (node.child[i] == CompressedBVHNode::kEmptyChild) continue;
+            float t0 = FLT_MIN, t1 = FLT_MAX;//与Bounds3::IntersectP保持一致
+            for (int a = 0; a < 3; ++a) {
+                float lo = node.origin[a] + node.qmin[a][i] * node.scale[a];
+                float hi = node.origin[a] + node.qmax[a][i] * node.scale[a];
+                float tl = (lo - orig[a]) * invDir[a], th = (hi - orig[a]) * invDir[a];
+                if (neg[a]) std::swap(tl, th);
+                t0 = std::max(t0, tl);
+                t1 = std::min(t1, th);
+            }
+            if (t0 > t1 || t1 < 0 || t0 > hit.t) continue;
+            //按进入距离从近到远插入排序
+            int k = hits++;
+            while (k > 0 && tEnter[k - 1] > t0) { tEnter[k] = tEnter[k - 1]; order[k] = order[k - 1]; --k; }
+            tEnter[k] = t0;
+            order[k] = i;
+        }
+        //叶子从近到远立即求交，先找到的近交点可以剪掉后面更远的孩子
+        for (int k = 0; k < hits; ++k) {
+            uint32_t c = node.child[order[k]];
+            if (!(c & CompressedBVHNode::kLeafFlag) || tEnter[k] > hit.t) continue;
+            Object* object = compressedPrims[c & ~CompressedBVHNode::kLeafFlag];
+            if (anyHit) {
+                if (object->intersectAny(ray, hit.t)) return true;
+            }
+            else {
+                found |= object->intersectHit(ray, hit);
+            }
+        }
+        //内部节点从远到近入栈，最近的孩子最先弹出
+        for (int k = hits - 1; k >= 0; --k) {
+            uint32_t c = node.child[order[k]];
+            if (!(c & CompressedBVHNode::kLeafFlag) && tEnter[k] <= hit.t) stack[top++] = c;
+        }
+    }
+    return found;
+}
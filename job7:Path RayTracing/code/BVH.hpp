@@ -1,8 +1,12 @@
 #ifndef RAYTRACING_BVH_H
 #define RAYTRACING_BVH_H
 #include <atomic>
+#include <chrono>
 #include <vector>
 #include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
 #include <ctime>
 #include "Object.hpp"
 #include "Ray.hpp"
@@ -13,6 +17,22 @@
 struct BVHBuildNode;
 struct BVHPrimitiveInfo;
 
+/*
+**压缩BVH节点：最多4个孩子，孩子包围盒相对父节点包围盒(origin + q * scale)量化为8位，保守取整保证只会变大
+**孩子序号最高位为1表示叶子(其余位为compressedPrims中的序号)，kEmptyChild表示空位；整个节点正好一条64字节cache line
+*/
+struct alignas(64) CompressedBVHNode {
+    static constexpr uint32_t kLeafFlag = 0x80000000u;
+    static constexpr uint32_t kEmptyChild = 0xFFFFFFFFu;
+
+    float origin[3];
+    float scale[3];
+    uint8_t qmin[3][4];
+    uint8_t qmax[3][4];
+    uint32_t child[4];
+};
+static_assert(sizeof(CompressedBVHNode) == 64, "CompressedBVHNode should fill one cache line");
+
 inline int leafNodes, totalLeafNodes, totalPrimitives, interiorNodes;
 
 /*
@@ -23,23 +43,88 @@ public:
     enum class SplitMethod { NAIVE, SAH };//切分方法
     const int maxPrimsInNode;//节点内的最大物体个数
     const SplitMethod splitMethod;//枚举类数据成员
+    const int lazyDepth;//大于0时为延迟构建：只预先构建前lazyDepth层，更深的子树在光线第一次进入时才构建
     std::vector<Object*> primitives;//容纳所有object的vector
-    BVHBuildNode* root;//BVH树根节点(可理解为：BVH树)
+    BVHBuildNode* root = nullptr;//BVH树根节点(可理解为：BVH树)
+    float buildCost = 0;//最近一次完整构建时的SAH代价
+    float rebuildThreshold = 1.5f;//SAH代价超过buildCost的这个倍数时，整体重建BVH树
+
+    //可选的压缩节点格式，是BVHBuildNode树之外的一份遍历数据：refit、插入删除和光源采样仍使用BVHBuildNode树
+    bool useCompressed = false;//为true时Intersect使用压缩节点遍历
+    static constexpr int kCompressedStackSize = 256;//压缩遍历的栈深度，树太深放不下时不启用压缩遍历
+    std::vector<CompressedBVHNode> compressedNodes;
+    std::vector<Object*> compressedPrims;
 
-    BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE);
+    BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE, int lazyDepth = 0);
     Bounds3 WorldBound() const;
     ~BVHAccel();
 
     Intersection Intersect(const Ray &ray) const;
-    Intersection getIntersection(BVHBuildNode* node, const Ray& ray)const;
+    //只求最近命中，不计算完整的相交数据；hit.t为当前上界，返回是否找到更近的命中
+    bool IntersectHit(const Ray &ray, Hit &hit) const;
+    bool getIntersection(BVHBuildNode* node, const Ray& ray, const Vector3f& invDir,
+                         const std::array<int, 3>& dirIsNeg, Hit& hit) const;
+    //任意命中：光线在(0, ray.t_max)或(0, tMax)内与任何物体相交即返回true，找到第一个命中就停止遍历
     bool IntersectP(const Ray &ray) const;
+    bool IntersectP(const Ray &ray, float tMax) const;
+    bool getOcclusion(BVHBuildNode* node, const Ray& ray, const Vector3f& invDir,
+                      const std::array<int, 3>& dirIsNeg, float tMax) const;
     
 
-    //传入所有objects，返回建立的BVH树根节点
-    BVHBuildNode* recursiveBuild(std::vector<Object*>objects);
+    //传入所有objects，返回建立的BVH树根节点；depth为当前构建深度，用于延迟构建
+    BVHBuildNode* recursiveBuild(std::vector<Object*>objects, int depth = 0) const;
+    //延迟构建的节点在第一次被访问时构建，多线程下只会构建一次；返回node下实际的子树根，普通节点原样返回
+    BVHBuildNode* expand(BVHBuildNode* node) const;
 
     void getSample(BVHBuildNode* node, float p, Intersection &pos, float &pdf);
     void Sample(Intersection &pos, float &pdf);
+
+    //动态场景：顶点或变换更新后自底向上重算包围盒；插入、删除顶层物体时只局部重建受影响的子树
+    void refit();
+    void insert(Object* object);
+    bool remove(Object* object);
+    void rebuild();
+    float SAHCost() const;
+
+    //由BVHBuildNode树生成4叉压缩节点并启用压缩遍历(延迟构建的子树会被全部展开)
+    void compress();
+    //anyHit为true时找到任一t小于hit.t的交点就返回(阴影光线)
+    bool getCompressedIntersection(const Ray& ray, Hit& hit, bool anyHit = false) const;
+
+    //构建后的优化：用树旋转降低SAH代价，对任意构建方法得到的树都适用；timeBudget为时间预算(秒)
+    float optimize(double timeBudget = 1.0);
+
+private:
+    /*
+    **延迟构建的状态放在旁表中，不占用普通节点的空间：延迟节点是没有孩子也没有物体的叶子，创建后不再改变
+    **第一次访问时由recursiveBuild构建出子树root，之后遍历经expand转到root；built保证只构建一次
+    */
+    struct DeferredSubtree {
+        std::vector<Object*> objects;//尚未构建的物体，构建后清空
+        std::once_flag built;
+        BVHBuildNode* root = nullptr;
+    };
+    mutable std::shared_mutex deferredMutex;//保护deferredNodes表本身(渲染线程构建子树时会插入新的延迟节点)
+    mutable std::unordered_map<const BVHBuildNode*, std::unique_ptr<DeferredSubtree>> deferredNodes;
+
+    //node为延迟节点时返回它的旁表项，否则返回nullptr
+    DeferredSubtree* deferredOf(const BVHBuildNode* node) const;
+    //更新操作之前把延迟节点构建出的子树直接挂到node上，node变为普通的内部节点(只在更新操作中使用，未展开的延迟节点由调用者直接修改物体列表)
+    void graft(BVHBuildNode* node);
+    void refitNode(BVHBuildNode* node);
+    BVHBuildNode* insertNode(BVHBuildNode* node, Object* object);
+    BVHBuildNode* removeNode(BVHBuildNode* node, Object* object, bool &found);
+    void collectObjects(BVHBuildNode* node, std::vector<Object*> &objects) const;
+    void freeNode(BVHBuildNode* node);
+    float nodeCost(BVHBuildNode* node) const;
+    void checkQuality();
+    void updateCompressed();
+    bool buildCompressed();
+    uint32_t compressNode(BVHBuildNode* node, int depth, int &maxDepth);
+    bool rotate(BVHBuildNode* node);
+    int rotateSubtree(BVHBuildNode* node, std::chrono::steady_clock::time_point deadline);
+    int rotateTop(BVHBuildNode* node, int depth, int splitDepth);
+    void collectSubtrees(BVHBuildNode* node, int depth, int splitDepth, std::vector<BVHBuildNode*> &subtrees);
 };
 
 /*
@@ -52,7 +137,7 @@ struct BVHBuildNode {
     Object* object;//包围盒内部物体类型
     float area;//BVH树的节点内包围盒面积
 public:
-    int splitAxis=0, firstPrimOffset=0, nPrimitives=0;
+    int splitAxis=0, firstPrimOffset=0, nPrimitives=0;//延迟构建的节点left、right、object都为空(见BVHAccel::DeferredSubtree)
 
     //无参构造函数
     BVHBuildNode(){
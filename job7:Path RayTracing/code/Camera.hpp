@@ -0,0 +1,68 @@
+#ifndef RAYTRACING_CAMERA_H
+#define RAYTRACING_CAMERA_H
+#include "global.hpp"
+#include "Ray.hpp"
+#include "Vector.hpp"
+
+inline float deg2rad(const float& deg) { return deg * M_PI / 180.0; }
+
+/*
+**针孔相机：位于eye、看向target，up为大致向上的方向，fov为竖直视场角(度)，width x height为输出分辨率
+**图像横轴沿crossProduct(up, forward)的反方向；默认值即原来固定的视点：从(278, 273, -800)看向+z
+*/
+struct Camera
+{
+    int width = 784, height = 784;
+    double fov = 40;
+    Vector3f eye = Vector3f(278, 273, -800);
+    Vector3f target = Vector3f(278, 273, 0);
+    Vector3f up = Vector3f(0, 1, 0);
+
+    Camera() = default;
+    Camera(int width, int height, double fov) : width(width), height(height), fov(fov) {}
+
+    //像素(i, j)中心的主光线
+    Ray generateRay(uint32_t i, uint32_t j) const
+    {
+        float scale = tan(deg2rad(fov * 0.5));//tan(fov/2)
+        float imageAspectRatio = width / (float)height;//屏幕宽高比
+
+        float x = (2 * (i + 0.5) / (float)width - 1) * imageAspectRatio * scale;
+        float y = (1 - 2 * (j + 0.5) / (float)height) * scale;
+
+        Vector3f forward = normalize(target - eye);
+        Vector3f right = normalize(crossProduct(up, forward));
+        Vector3f upward = crossProduct(forward, right);
+        Vector3f dir = normalize(forward + right * -x + upward * y);
+        return Ray(eye, dir);
+    }
+
+    //generateRay的逆：世界坐标p投影到图像上的连续像素坐标(i, j)(像素中心为整数)，p在相机后方时返回false
+    bool project(const Vector3f& p, float& i, float& j) const
+    {
+        float scale = tan(deg2rad(fov * 0.5));
+        float imageAspectRatio = width / (float)height;
+        Vector3f forward = normalize(target - eye);
+        Vector3f right = normalize(crossProduct(up, forward));
+        Vector3f upward = crossProduct(forward, right);
+        Vector3f d = p - eye;
+        float z = dotProduct(d, forward);
+        if (z <= 0) return false;
+        float x = -dotProduct(d, right) / z, y = dotProduct(d, upward) / z;
+        i = (x / (imageAspectRatio * scale) + 1) * width / 2 - 0.5f;
+        j = (1 - y / scale) * height / 2 - 0.5f;
+        return true;
+    }
+
+    //把视点绕过target、沿up方向的轴旋转degrees度(转台、环绕拍摄)，其余参数不变
+    Camera orbit(float degrees) const
+    {
+        Camera result = *this;
+        Vector3f k = normalize(up), v = eye - target;
+        float c = std::cos(deg2rad(degrees)), s = std::sin(deg2rad(degrees));
+        result.eye = target + v * c + crossProduct(k, v) * s + k * dotProduct(k, v) * (1 - c);
+        return result;
+    }
+};
+
+#endif //RAYTRACING_CAMERA_H
@@ -0,0 +1,63 @@
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+#include "Checkpoint.hpp"
+
+static const char kMagic[4] = {'R', 'T', 'C', 'K'};
+static const uint32_t kVersion = 1;
+
+void Checkpoint::save(const std::string& path) const
+{
+    std::string tmp = path + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if (!fp) throw std::runtime_error("cannot create checkpoint " + tmp);
+
+    int32_t header[3] = {width, height, spp};
+    size_t n = size_t(width) * height;
+    std::vector<float> values(n * 3);
+    for (size_t k = 0; k < n; ++k) {
+        values[3 * k] = accum[k].x;
+        values[3 * k + 1] = accum[k].y;
+        values[3 * k + 2] = accum[k].z;
+    }
+    bool ok = fwrite(kMagic, 1, 4, fp) == 4 && fwrite(&kVersion, sizeof(kVersion), 1, fp) == 1 &&
+              fwrite(header, sizeof(header), 1, fp) == 1 && fwrite(&seed, sizeof(seed), 1, fp) == 1 &&
+              fwrite(values.data(), sizeof(float), values.size(), fp) == values.size() &&
+              fwrite(samples.data(), sizeof(uint32_t), n, fp) == n;
+    ok = fflush(fp) == 0 && ok;
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+        std::remove(tmp.c_str());
+        throw std::runtime_error("cannot write checkpoint " + path);
+    }
+}
+
+bool Checkpoint::load(const std::string& path)
+{
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (!fp) return false;
+
+    char magic[4];
+    uint32_t version = 0;
+    int32_t header[3];
+    bool ok = fread(magic, 1, 4, fp) == 4 && std::equal(magic, magic + 4, kMagic) &&
+              fread(&version, sizeof(version), 1, fp) == 1 && version == kVersion &&
+              fread(header, sizeof(header), 1, fp) == 1 && header[0] > 0 && header[1] > 0 &&
+              fread(&seed, sizeof(seed), 1, fp) == 1;
+    if (ok) {
+        width = header[0];
+        height = header[1];
+        spp = header[2];
+        size_t n = size_t(width) * height;
+        std::vector<float> values(n * 3);
+        samples.resize(n);
+        ok = fread(values.data(), sizeof(float), values.size(), fp) == values.size() &&
+             fread(samples.data(), sizeof(uint32_t), n, fp) == n;
+        accum.resize(n);
+        for (size_t k = 0; ok && k < n; ++k)
+            accum[k] = Vector3f(values[3 * k], values[3 * k + 1], values[3 * k + 2]);
+    }
+    fclose(fp);
+    if (!ok) throw std::runtime_error(path + " is not a valid checkpoint");
+    return true;
+}
@@ -0,0 +1,26 @@
+#ifndef RAYTRACING_CHECKPOINT_H
+#define RAYTRACING_CHECKPOINT_H
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "Vector.hpp"
+
+/*
+**渐进渲染的检查点：累加缓冲、每个像素已完成的样本数和采样器状态
+**采样器在每个(像素, 样本序号)处由seed重新设定种子(见seed_random)，所以采样器状态只需要seed和样本数
+**文件格式：魔数"RTCK"、版本、宽、高、spp、seed，随后是width * height个累加值(3个float)和样本数(uint32)
+*/
+struct Checkpoint
+{
+    int width = 0, height = 0, spp = 0;
+    uint64_t seed = 0;
+    std::vector<Vector3f> accum;//每个像素已完成样本的累加值，每个样本的权重为1/spp
+    std::vector<uint32_t> samples;
+
+    //先写入path.tmp再重命名，写到一半被中断时原有的检查点不受影响；失败时抛出std::runtime_error
+    void save(const std::string& path) const;
+    //文件不存在时返回false，文件损坏时抛出std::runtime_error
+    bool load(const std::string& path);
+};
+
+#endif //RAYTRACING_CHECKPOINT_H
@@ -0,0 +1,153 @@
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include "Denoiser.hpp"
+#include "Scene.hpp"
+
+AOVBuffers renderAOVs(const Scene& scene, const Camera& camera)
+{
+    AOVBuffers aov;
+    aov.width = camera.width;
+    aov.height = camera.height;
+    size_t n = size_t(camera.width) * camera.height;
+    aov.albedo.assign(n, Vector3f(0));
+    aov.normal.assign(n, Vector3f(0));
+    aov.depth.assign(n, 0);
+    ThreadPool::shared().parallelFor(camera.height, 1, [&](size_t begin, size_t end) {
+        for (int j = int(begin); j < int(end); ++j)
+            for (int i = 0; i < camera.width; ++i) {
+                Intersection hit = scene.intersect(camera.generateRay(i, j));
+                if (!hit.happened) continue;
+                size_t k = size_t(j) * camera.width + i;
+                aov.albedo[k] = hit.m ? hit.m->Kd : Vector3f(0);
+                aov.normal[k] = hit.normal;
+                aov.depth[k] = float(hit.distance);
+            }
+    });
+    return aov;
+}
+
+/*
+**exp(x)的近似，x <= 0：exp(x) = 2^i * 2^f，i为x * log2(e)就近取整，f在[-0.5, 0.5]上用5阶多项式求2^f，相对误差约5e-6
+**只有乘加和整数运算，没有errno和分支，内层循环可以向量化；std::exp要设置errno，会阻止向量化
+**负数的位模式按无符号数比较时随绝对值增大，取较小者即把指数限制在-126以上(浮点数的min会被编译成分支)
+**x < -87时结果是很小的非负数而不是0，作为权重没有影响
+*/
+static inline float expNegative(float x)
+{
+    float t = std::bit_cast<float>(std::min(std::bit_cast<uint32_t>(x * 1.44269504f), std::bit_cast<uint32_t>(-126.0f)));
+    float r = t + 12582912.0f;//加1.5 * 2^23后尾数的低位就是就近取整的结果
+    int i = std::bit_cast<int>(r) - 0x4B400000;
+    float f = (t - (r - 12582912.0f)) * 0.693147181f;
+    float p = 1 + f * (1 + f * (1.0f / 2 + f * (1.0f / 6 + f * (1.0f / 24 + f * (1.0f / 120)))));
+    return p * std::bit_cast<float>((i + 127) << 23);
+}
+
+//按通道分开存储的滤波输入：辐照度、albedo、法向量和深度
+struct FilterPlanes
+{
+    const float *c[3], *a[3], *n[3], *z;
+};
+
+//边缘停止函数的系数，invDist已包含邻居的像素距离
+struct TapWeights
+{
+    float hk, invColor, invAlbedo, normalPower, invDist;
+};
+
+/*
+**把行首为row的像素x0..x1-1与行首为qrow(已加上横向偏移)的同一个邻居比较，累加权重和加权的辐照度
+**内层循环只有连续的加载、乘加和一次expNegative，没有分支和函数调用；累加数组用__restrict声明与输入不重叠，编译器向量化
+*/
+static void accumulateTap(const FilterPlanes& in, size_t row, size_t qrow, int x0, int x1, const TapWeights& k,
+                          float* __restrict sumW, float* __restrict sum0, float* __restrict sum1, float* __restrict sum2)
+{
+    const float *c0 = in.c[0], *c1 = in.c[1], *c2 = in.c[2], *a0 = in.a[0], *a1 = in.a[1], *a2 = in.a[2];
+    const float *n0 = in.n[0], *n1 = in.n[1], *n2 = in.n[2], *z = in.z;
+    const float hk = k.hk, invColor = k.invColor, invAlbedo = k.invAlbedo, normalPower = k.normalPower, invDist = k.invDist;
+    for (int x = x0; x < x1; ++x) {
+        const size_t p = row + x, q = qrow + x;
+        float d0 = c0[p] - c0[q], d1 = c1[p] - c1[q], d2 = c2[p] - c2[q];
+        float e0 = a0[p] - a0[q], e1 = a1[p] - a1[q], e2 = a2[p] - a2[q];
+        float cosN = n0[p] * n0[q] + n1[p] * n1[q] + n2[p] * n2[q];
+        float dz = std::fabs(z[p] - z[q]) / (z[p] + 1e-3f);
+        float weight = hk * expNegative(-((d0 * d0 + d1 * d1 + d2 * d2) * invColor + (e0 * e0 + e1 * e1 + e2 * e2) * invAlbedo +
+                                          (1 - cosN) * normalPower + dz * invDist));
+        sumW[x] += weight;
+        sum0[x] += weight * c0[q];
+        sum1[x] += weight * c1[q];
+        sum2[x] += weight * c2[q];
+    }
+}
+
+std::vector<Vector3f> Denoiser::denoise(const std::vector<Vector3f>& color, const AOVBuffers& aov) const
+{
+    const int w = aov.width, h = aov.height;
+    const size_t n = size_t(w) * h;
+    static const float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+
+    //拆成单通道平面；辐照度 = 颜色 / albedo，albedo接近0(未命中、黑色材质)的通道不做除法
+    std::vector<float> c[3], next[3], a[3], nrm[3], depth(aov.depth);
+    auto divisor = [](float albedo) { return albedo > 1e-3f ? albedo : 1.0f; };
+    for (int ch = 0; ch < 3; ++ch) {
+        c[ch].resize(n);
+        next[ch].resize(n);
+        a[ch].resize(n);
+        nrm[ch].resize(n);
+    }
+    for (size_t k = 0; k < n; ++k) {
+        const Vector3f &col = color[k], &alb = aov.albedo[k], &nor = aov.normal[k];
+        c[0][k] = col.x / divisor(alb.x), c[1][k] = col.y / divisor(alb.y), c[2][k] = col.z / divisor(alb.z);
+        a[0][k] = alb.x, a[1][k] = alb.y, a[2][k] = alb.z;
+        nrm[0][k] = nor.x, nrm[1][k] = nor.y, nrm[2][k] = nor.z;
+    }
+
+    for (int it = 0; it < iterations; ++it) {
+        const int step = 1 << it;
+        const float sigmaC = sigmaColor / step;
+        const float invColor = 1 / (sigmaC * sigmaC), invAlbedo = 1 / (sigmaAlbedo * sigmaAlbedo);
+        //c和next每次迭代后交换，每次重新取指针
+        const FilterPlanes planes = {{c[0].data(), c[1].data(), c[2].data()},
+                                     {a[0].data(), a[1].data(), a[2].data()},
+                                     {nrm[0].data(), nrm[1].data(), nrm[2].data()},
+                                     depth.data()};
+        ThreadPool::shared().parallelFor(h, 8, [&](size_t begin, size_t end) {
+            std::vector<float> sumW(w), sum0(w), sum1(w), sum2(w);
+            for (int j = int(begin); j < int(end); ++j) {
+                std::fill(sumW.begin(), sumW.end(), 0.0f);
+                std::fill(sum0.begin(), sum0.end(), 0.0f);
+                std::fill(sum1.begin(), sum1.end(), 0.0f);
+                std::fill(sum2.begin(), sum2.end(), 0.0f);
+                const size_t row = size_t(j) * w;
+                for (int dy = -2; dy <= 2; ++dy) {
+                    int jj = j + dy * step;
+                    if (jj < 0 || jj >= h) continue;
+                    for (int dx = -2; dx <= 2; ++dx) {
+                        const int off = dx * step;
+                        const float hk = kernel[dy + 2] * kernel[dx + 2];
+                        const float invDist = 1 / (sigmaDepth * step * (std::abs(dx) + std::abs(dy)) + 1e-6f);
+                        const size_t qrow = size_t(jj) * w + off;
+                        const int x0 = std::max(0, -off), x1 = std::min(w, w - off);
+                        accumulateTap(planes, row, qrow, x0, x1, {hk, invColor, invAlbedo, normalPower, invDist},
+                                      sumW.data(), sum0.data(), sum1.data(), sum2.data());
+                    }
+                }
+                for (int x = 0; x < w; ++x) {
+                    float inv = sumW[x] > 0 ? 1 / sumW[x] : 0;
+                    next[0][row + x] = sum0[x] * inv;
+                    next[1][row + x] = sum1[x] * inv;
+                    next[2][row + x] = sum2[x] * inv;
+                }
+            }
+        });
+        for (int ch = 0; ch < 3; ++ch) std::swap(c[ch], next[ch]);
+    }
+
+    std::vector<Vector3f> result(n);
+    for (size_t k = 0; k < n; ++k) {
+        const Vector3f& alb = aov.albedo[k];
+        result[k] = Vector3f(c[0][k] * divisor(alb.x), c[1][k] * divisor(alb.y), c[2][k] * divisor(alb.z));
+    }
+    return result;
+}
@@ -0,0 +1,42 @@
+#ifndef RAYTRACING_DENOISER_H
+#define RAYTRACING_DENOISER_H
+#include <vector>
+#include "Camera.hpp"
+#include "Vector.hpp"
+
+class Scene;
+
+/*
+**辅助缓冲(AOV)：每个像素中心的主光线第一次命中处的漫反射率(Material::Kd)、法向量和距离
+**与默认模式的主光线相同，和渲染结果逐像素对齐；未命中的像素albedo、normal为0，depth为0
+*/
+struct AOVBuffers
+{
+    int width = 0, height = 0;
+    std::vector<Vector3f> albedo;
+    std::vector<Vector3f> normal;
+    std::vector<float> depth;
+};
+
+//用共享线程池按行并行追踪主光线，生成camera视角下的AOV
+AOVBuffers renderAOVs(const Scene& scene, const Camera& camera);
+
+/*
+**à-trous小波降噪(Dammertz et al. 2010)：以5x5的B样条核迭代iterations次，第i次的采样间隔为2^i个像素
+**每个邻居的权重再乘以颜色、法向量、深度、漫反射率的边缘停止函数，不跨越几何与材质的边界平滑
+**滤波前先除以albedo(只对辐照度滤波)，滤波后再乘回，保留材质的颜色细节
+**数据按通道分开存储(SoA)，每行内对同一个偏移的邻居连续计算，权重中的exp用多项式近似，编译器可以向量化内层循环；
+**各行由共享线程池并行处理
+*/
+struct Denoiser
+{
+    int iterations = 3;
+    float sigmaColor = 1.25f;//颜色差的尺度(辐照度)，每次迭代减半
+    float normalPower = 64;//法向量权重为exp(-(1 - n_p·n_q) * normalPower)，n_p·n_q接近1时与(n_p·n_q)^normalPower相同
+    float sigmaDepth = 0.02f;//相对深度差的尺度(每像素距离)
+    float sigmaAlbedo = 0.1f;
+
+    std::vector<Vector3f> denoise(const std::vector<Vector3f>& color, const AOVBuffers& aov) const;
+};
+
+#endif //RAYTRACING_DENOISER_H
@@ -0,0 +1,388 @@
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <netdb.h>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include "Distributed.hpp"
+
+namespace {
+
+enum MessageType : uint8_t { Config = 1, Tile = 2, Result = 3, Quit = 4 };
+
+struct MessageWriter
+{
+    std::string data;
+    template <typename T> MessageWriter& put(const T& value)
+    {
+        data.append(reinterpret_cast<const char*>(&value), sizeof(T));
+        return *this;
+    }
+};
+
+struct MessageReader
+{
+    const std::string& data;
+    size_t pos = 0;
+    template <typename T> bool get(T& value)
+    {
+        if (pos + sizeof(T) > data.size()) return false;
+        memcpy(&value, data.data() + pos, sizeof(T));
+        pos += sizeof(T);
+        return true;
+    }
+};
+
+bool isTcp(const std::string& address) { return address.compare(0, 4, "tcp:") == 0; }
+
+//"tcp:host:port"拆成host和port，host为空时返回空串
+void splitTcp(const std::string& address, std::string& host, std::string& port)
+{
+    std::string rest = address.substr(4);
+    size_t colon = rest.rfind(':');
+    if (colon == std::string::npos) throw std::runtime_error("expected tcp:host:port, got " + address);
+    host = rest.substr(0, colon);
+    port = rest.substr(colon + 1);
+}
+
+sockaddr_un unixAddress(const std::string& path)
+{
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) throw std::runtime_error("socket path too long: " + path);
+    strcpy(addr.sun_path, path.c_str());
+    return addr;
+}
+
+}
+
+SocketChannel::~SocketChannel()
+{
+    ::close(fd);
+}
+
+void SocketChannel::close()
+{
+    shutdown(fd, SHUT_RDWR);
+}
+
+bool SocketChannel::send(const std::string& message)
+{
+    uint32_t size = uint32_t(message.size());
+    std::string frame(reinterpret_cast<const char*>(&size), sizeof(size));
+    frame += message;
+    for (size_t sent = 0; sent < frame.size();) {
+        ssize_t n = ::send(fd, frame.data() + sent, frame.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        sent += size_t(n);
+    }
+    return true;
+}
+
+bool SocketChannel::readAll(char* data, size_t size, double timeout)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(timeout);
+    while (size > 0) {
+        if (timeout >= 0) {
+            double left = std::chrono::duration<double>(deadline - std::chrono::steady_clock::now()).count();
+            pollfd p{fd, POLLIN, 0};
+            if (left <= 0 || poll(&p, 1, int(left * 1000) + 1) <= 0) return false;
+        }
+        ssize_t n = ::recv(fd, data, size, 0);
+        if (n <= 0) return false;
+        data += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+bool SocketChannel::receive(std::string& message, double timeout)
+{
+    uint32_t size;
+    if (!readAll(reinterpret_cast<char*>(&size), sizeof(size), timeout)) return false;
+    message.resize(size);
+    return readAll(&message[0], size, timeout);
+}
+
+Listener::Listener(const std::string& address)
+{
+    if (isTcp(address)) {
+        std::string host, port;
+        splitTcp(address, host, port);
+        addrinfo hints{}, *res = nullptr;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res) != 0 || !res)
+            throw std::runtime_error("cannot resolve " + address);
+        fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        int one = 1;
+        if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        bool ok = fd >= 0 && bind(fd, res->ai_addr, res->ai_addrlen) == 0;
+        freeaddrinfo(res);
+        if (!ok) throw std::runtime_error("cannot bind " + address);
+    } else {
+        sockaddr_un addr = unixAddress(address);
+        unlink(address.c_str());
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+            throw std::runtime_error("cannot bind " + address);
+        unixPath = address;
+    }
+    if (listen(fd, 64) != 0) throw std::runtime_error("cannot listen on " + address);
+}
+
+Listener::~Listener()
+{
+    if (fd >= 0) ::close(fd);
+    if (!unixPath.empty()) unlink(unixPath.c_str());
+}
+
+void Listener::stop()
+{
+    shutdown(fd, SHUT_RDWR);
+}
+
+std::unique_ptr<Channel> Listener::accept()
+{
+    int client = ::accept(fd, nullptr, nullptr);
+    if (client < 0) throw std::runtime_error("accept failed");
+    return std::make_unique<SocketChannel>(client);
+}
+
+std::unique_ptr<Channel> connectTo(const std::string& address)
+{
+    int fd = -1;
+    if (isTcp(address)) {
+        std::string host, port;
+        splitTcp(address, host, port);
+        addrinfo hints{}, *res = nullptr;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host.empty() ? "localhost" : host.c_str(), port.c_str(), &hints, &res) != 0 || !res)
+            throw std::runtime_error("cannot resolve " + address);
+        fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        bool ok = fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) == 0;
+        freeaddrinfo(res);
+        if (!ok) {
+            if (fd >= 0) close(fd);
+            throw std::runtime_error("cannot connect to " + address);
+        }
+    } else {
+        sockaddr_un addr = unixAddress(address);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            if (fd >= 0) close(fd);
+            throw std::runtime_error("cannot connect to " + address);
+        }
+    }
+    return std::make_unique<SocketChannel>(fd);
+}
+
+/*
+**消息格式(首字节为类型)：
+**Config: spp, seed, 相机    Tile: id, x0, y0, x1, y1    Result: id, 图块的3 * n个float    Quit: 无
+*/
+void runWorker(const Scene& scene, Renderer renderer, Channel& channel)
+{
+    Camera camera;
+    std::string message;
+    while (channel.receive(message)) {
+        MessageReader in{message};
+        uint8_t type = 0;
+        in.get(type);
+        if (type == Config) {
+            int32_t spp = 0;
+            if (!in.get(spp) || !in.get(renderer.seed) || !in.get(camera)) return;
+            renderer.spp = spp;
+        } else if (type == Tile) {
+            uint32_t id;
+            TileRect rect;
+            if (!in.get(id) || !in.get(rect.x0) || !in.get(rect.y0) || !in.get(rect.x1) || !in.get(rect.y1)) return;
+            //图块按行分给本进程的线程池
+            int w = rect.x1 - rect.x0;
+            std::vector<Vector3f> tile(w * (rect.y1 - rect.y0));
+            ThreadPool::shared().parallelFor(rect.y1 - rect.y0, 1, [&](size_t begin, size_t end) {
+                for (size_t r = begin; r < end; ++r) {
+                    int y = rect.y0 + int(r);
+                    std::vector<Vector3f> row = renderer.renderTile(scene, camera, TileRect{rect.x0, y, rect.x1, y + 1});
+                    std::copy(row.begin(), row.end(), tile.begin() + r * w);
+                }
+            });
+            MessageWriter out;
+            out.put(uint8_t(Result)).put(id);
+            for (auto& v : tile)
+                out.put(v.x).put(v.y).put(v.z);
+            if (!channel.send(out.data)) return;
+        } else {
+            return;
+        }
+    }
+}
+
+std::vector<pid_t> forkWorkers(const std::function<SceneBundle()>& loadScene, const Renderer& renderer,
+                               const std::string& address, int count)
+{
+    if (count > 0 && ThreadPool::sharedCreated())
+        throw std::runtime_error("forkWorkers must be called before the shared thread pool is created");
+    std::vector<pid_t> pids;
+    for (int k = 0; k < count; ++k) {
+        pid_t pid = fork();
+        if (pid == 0) {//子进程不返回调用者，异常也在这里结束
+            try {
+                SceneBundle bundle = loadScene();
+                runWorker(*bundle.scene, renderer, *connectTo(address));
+            } catch (const std::exception& e) {
+                fprintf(stderr, "worker %d: %s\n", k, e.what());
+                _exit(1);
+            }
+            _exit(0);
+        }
+        if (pid < 0) throw std::runtime_error("fork failed");
+        pids.push_back(pid);
+    }
+    return pids;
+}
+
+Coordinator::Coordinator(std::vector<std::unique_ptr<Channel>> workers) : workers(std::move(workers)) {}
+
+Coordinator::~Coordinator()
+{
+    std::string quit(1, char(Quit));
+    for (auto& worker : workers)
+        if (worker) worker->send(quit);
+}
+
+size_t Coordinator::alive() const
+{
+    size_t n = 0;
+    for (auto& worker : workers)
+        n += worker != nullptr;
+    return n;
+}
+
+void Coordinator::render(const Renderer& settings, RenderJob& job, const std::vector<TileRect>& tiles, int tileCount,
+                         const std::function<void()>& afterTile)
+{
+    using Clock = std::chrono::steady_clock;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<int> pending;
+    std::vector<int> copies(tiles.size(), 0);//正在渲染该图块的worker数
+    std::vector<Clock::time_point> started(tiles.size());
+    std::vector<bool> done(tiles.size(), false);
+    std::vector<bool> busy(workers.size(), false);//worker正在等待图块结果
+    size_t remaining = tiles.size();
+    size_t running = 0;//尚未退出的serve线程数
+    for (int t = 0; t < (int)tiles.size(); ++t)
+        pending.push_back(t);
+
+    //在持有mutex时调用：先取队列中的图块，队列为空时取运行最久且只有一份的图块重复渲染
+    auto take = [&]() -> int {
+        if (!pending.empty()) {
+            int t = pending.front();
+            pending.pop_front();
+            return t;
+        }
+        int oldest = -1;
+        auto threshold = Clock::now() - std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(speculateAfter));
+        for (int t = 0; t < (int)tiles.size(); ++t)
+            if (!done[t] && copies[t] == 1 && started[t] < threshold && (oldest < 0 || started[t] < started[oldest]))
+                oldest = t;
+        return oldest;
+    };
+
+    std::string config = MessageWriter()
+        .put(uint8_t(Config)).put(int32_t(settings.spp)).put(settings.seed).put(job.camera).data;
+
+    auto serve = [&](size_t w) {
+        Channel& channel = *workers[w];
+        bool ok = channel.send(config);
+        std::string message;
+        while (ok) {
+            int t = -1;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                while (remaining > 0 && !job.cancelled() && (t = take()) < 0)
+                    changed.wait_for(lock, std::chrono::milliseconds(50));
+                if (t < 0) {
+                    --running;
+                    changed.notify_all();
+                    return;
+                }
+                if (copies[t]++ == 0) started[t] = Clock::now();
+                busy[w] = true;
+            }
+
+            const TileRect& rect = tiles[t];
+            std::vector<Vector3f> tile((rect.x1 - rect.x0) * (rect.y1 - rect.y0));
+            MessageWriter request;
+            request.put(uint8_t(Tile)).put(uint32_t(t)).put(rect.x0).put(rect.y0).put(rect.x1).put(rect.y1);
+            ok = channel.send(request.data) && channel.receive(message, tileTimeout);
+            if (ok) {
+                MessageReader in{message};
+                uint8_t type = 0;
+                uint32_t id = 0;
+                ok = in.get(type) && type == Result && in.get(id) && id == uint32_t(t);
+                for (auto& v : tile)
+                    ok = ok && in.get(v.x) && in.get(v.y) && in.get(v.z);
+            }
+
+            std::unique_lock<std::mutex> lock(mutex);
+            busy[w] = false;
+            --copies[t];
+            if (ok && !done[t]) {
+                done[t] = true;
+                --remaining;
+                lock.unlock();
+                job.finishTile(rect.x0, rect.y0, rect.x1, rect.y1, tile, settings.spp, tileCount);
+                afterTile();
+                lock.lock();
+            } else if (!ok && !done[t] && copies[t] == 0) {
+                pending.push_front(t);
+            }
+            changed.notify_all();
+        }
+
+        //worker失效：关闭连接，它手上的图块已在上面放回队列
+        std::lock_guard<std::mutex> lock(mutex);
+        if (job.cancelled()) printf(" - Worker %zu dropped: its tile was still running when the job was cancelled\n", w);
+        else printf(" - Worker %zu failed, reassigning its work\n", w);
+        workers[w].reset();
+        --running;
+        changed.notify_all();
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t w = 0; w < workers.size(); ++w)
+        if (workers[w]) {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++running;
+            threads.emplace_back(serve, w);
+        }
+
+    //取消时关闭正在等待结果的worker连接，否则serve线程要阻塞到tileTimeout；空闲的worker保留给后续渲染
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        bool closed = false;
+        while (running > 0) {
+            if (!closed && job.cancelled()) {
+                for (size_t w = 0; w < workers.size(); ++w)
+                    if (busy[w] && workers[w]) workers[w]->close();
+                closed = true;
+            }
+            changed.wait_for(lock, std::chrono::milliseconds(50));
+        }
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    if (remaining > 0 && !job.cancelled())
+        throw std::runtime_error("all workers failed with " + std::to_string(remaining) + " tiles left");
+}
@@ -0,0 +1,104 @@
+#ifndef RAYTRACING_DISTRIBUTED_H
+#define RAYTRACING_DISTRIBUTED_H
+#include <functional>
+#include <memory>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+#include "Renderer.hpp"
+
+/*
+**协调者与worker之间的消息通道：每次收发一条完整的消息
+**换成其他传输方式时只需实现这两个操作
+*/
+class Channel
+{
+public:
+    virtual ~Channel() = default;
+    virtual bool send(const std::string& message) = 0;
+    //timeout(秒)小于0时一直等待；超时或连接断开时返回false
+    virtual bool receive(std::string& message, double timeout = -1) = 0;
+    //断开连接，使其他线程中阻塞的receive返回false
+    virtual void close() {}
+};
+
+/*
+**基于套接字(Unix域套接字、TCP连接或socketpair)的通道，每条消息前加4字节长度
+*/
+class SocketChannel : public Channel
+{
+public:
+    explicit SocketChannel(int fd) : fd(fd) {}
+    ~SocketChannel() override;
+    SocketChannel(const SocketChannel&) = delete;
+    SocketChannel& operator=(const SocketChannel&) = delete;
+
+    bool send(const std::string& message) override;
+    bool receive(std::string& message, double timeout = -1) override;
+    void close() override;
+
+private:
+    bool readAll(char* data, size_t size, double timeout);
+    int fd;
+};
+
+/*
+**地址格式："tcp:host:port"(监听时host可为空，表示所有网卡)，其余按Unix域套接字的路径处理
+**创建、连接失败时抛出std::runtime_error
+*/
+class Listener
+{
+public:
+    explicit Listener(const std::string& address);
+    ~Listener();
+    Listener(const Listener&) = delete;
+    Listener& operator=(const Listener&) = delete;
+
+    std::unique_ptr<Channel> accept();
+    //使阻塞的accept抛出异常返回
+    void stop();
+
+private:
+    int fd = -1;
+    std::string unixPath;//Unix域套接字的路径，析构时删除
+};
+
+std::unique_ptr<Channel> connectTo(const std::string& address);
+
+//worker：接收协调者发来的渲染设置和图块，用本进程的线程池渲染后返回；收到结束消息或连接断开时返回
+void runWorker(const Scene& scene, Renderer renderer, Channel& channel);
+/*
+**在本机fork出count个worker进程连接到address(必须已经在监听)，返回子进程号
+**子进程只继承调用fork的线程，所以必须在本进程创建任何线程(包括共享线程池，例如加载场景)之前调用，否则抛出std::runtime_error
+**每个子进程调用loadScene各自加载场景，在自己新建的线程池上渲染
+*/
+std::vector<pid_t> forkWorkers(const std::function<SceneBundle()>& loadScene, const Renderer& renderer,
+                               const std::string& address, int count);
+
+/*
+**分布式渲染的协调者：每个worker一个线程，从共享队列领取图块发给worker，收到结果后写回RenderJob
+**worker出错、断开或超过tileTimeout没有返回时认为失效，它手上的图块放回队列由其他worker渲染
+**任务取消时，还在渲染图块的worker连接被关闭并视为失效(它的结果已无用，留在连接上会打乱后续消息)
+**队列取空后，空闲的worker重复渲染已运行超过speculateAfter秒的图块，先返回的结果有效，避免等待慢的机器
+**每个像素的样本都由(seed, 像素, 样本序号)确定，所以结果与图块由哪个worker渲染无关，与本机渲染逐位相同
+**消息按本机字节序编码，所有机器需要是相同的字节序
+*/
+class Coordinator
+{
+public:
+    explicit Coordinator(std::vector<std::unique_ptr<Channel>> workers);
+    ~Coordinator();//通知仍然有效的worker结束
+
+    //由Renderer::RenderTiles调用；所有worker都失效而图块没有渲染完时抛出std::runtime_error
+    void render(const Renderer& settings, RenderJob& job, const std::vector<TileRect>& tiles, int tileCount,
+                const std::function<void()>& afterTile);
+    size_t alive() const;
+
+    double tileTimeout = 300;
+    double speculateAfter = 2;
+
+private:
+    std::vector<std::unique_ptr<Channel>> workers;//失效的worker置为空
+};
+
+#endif //RAYTRACING_DISTRIBUTED_H
@@ -24,4 +24,18 @@ struct Intersection
     Object* obj;//物体类型
     Material* m;//材质类型
 };
+
+/*
+**遍历阶段使用的轻量命中记录：只记录距离、图元序号和重心坐标
+**最近交点确定之后，再由obj->getSurfaceInteraction计算一次完整的Intersection
+*/
+struct Hit
+{
+    float t = std::numeric_limits<float>::max();//光线参数
+    uint32_t primId = 0;//obj内的图元序号(如网格的面序号)
+    float b1 = 0, b2 = 0;//重心坐标，分别对应v1、v2
+    Object* obj = nullptr;//负责计算完整相交数据的物体
+
+    bool happened() const { return obj != nullptr; }
+};
 #endif //RAYTRACING_INTERSECTION_H
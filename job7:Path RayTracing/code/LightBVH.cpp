@@ -0,0 +1,169 @@
+#include <algorithm>
+#include "LightBVH.hpp"
+#include "Triangle.hpp"
+
+DirectionCone Union(const DirectionCone& a, const DirectionCone& b)
+{
+    if (a.isEmpty()) return b;
+    if (b.isEmpty()) return a;
+
+    //一个锥完全包含另一个时直接返回大的那个
+    float theta_a = std::acos(clamp(-1, 1, a.cosTheta)), theta_b = std::acos(clamp(-1, 1, b.cosTheta));
+    float theta_d = std::acos(clamp(-1, 1, dotProduct(a.axis, b.axis)));
+    if (std::min(theta_d + theta_b, M_PI) <= theta_a) return a;
+    if (std::min(theta_d + theta_a, M_PI) <= theta_b) return b;
+
+    //否则新锥的半角为(theta_a + theta_d + theta_b) / 2，轴由a.axis朝b.axis旋转theta_o - theta_a
+    float theta_o = (theta_a + theta_d + theta_b) / 2;
+    if (theta_o >= M_PI) return DirectionCone::EntireSphere();
+    Vector3f wr = crossProduct(a.axis, b.axis);
+    if (dotProduct(wr, wr) == 0) return DirectionCone::EntireSphere();
+    float theta_r = theta_o - theta_a;
+    Vector3f axis = a.axis * std::cos(theta_r) + crossProduct(normalize(wr), a.axis) * std::sin(theta_r);
+    return DirectionCone(normalize(axis), std::cos(theta_o));
+}
+
+LightBVH::LightBVH(const std::vector<Object*>& objects)
+{
+    for (auto obj : objects) {
+        if (!obj->hasEmit()) continue;
+        if (auto mesh = dynamic_cast<MeshTriangle*>(obj)) {
+            Vector3f emit = mesh->m->getEmission();
+            float luminance = (emit.x + emit.y + emit.z) / 3;
+            for (auto& face : mesh->faces) {
+                Vector3f N = normalize(crossProduct(face.v1() - face.v0(), face.v2() - face.v0()));
+                lights.push_back({&face, face.getBounds(), DirectionCone(N, 1), luminance * face.getArea(), emit});
+            }
+        } else if (auto tri = dynamic_cast<Triangle*>(obj)) {
+            Vector3f emit = tri->m->getEmission();
+            lights.push_back({tri, tri->getBounds(), DirectionCone(tri->normal, 1),
+                              (emit.x + emit.y + emit.z) / 3 * tri->area, emit});
+        } else {
+            //没有统一的材质接口，采样一次得到自发光；法向量范围按整个球面处理
+            Intersection probe;
+            float pdf;
+            obj->Sample(probe, pdf);
+            Vector3f emit = probe.emit;
+            lights.push_back({obj, obj->getBounds(), DirectionCone::EntireSphere(),
+                              (emit.x + emit.y + emit.z) / 3 * obj->getArea(), emit});
+        }
+    }
+    if (!lights.empty()) {
+        nodes.reserve(2 * lights.size() - 1);
+        recursiveBuild(0, int(lights.size()));
+    }
+}
+
+/*
+**与BVHAccel的NAIVE划分相同：按质心最长轴的中位数把光源分成两半
+*/
+int LightBVH::recursiveBuild(int begin, int end)
+{
+    int index = int(nodes.size());
+    nodes.emplace_back();
+    if (end - begin == 1) {
+        nodes[index].bounds = lights[begin].bounds;
+        nodes[index].cone = lights[begin].cone;
+        nodes[index].phi = lights[begin].phi;
+        nodes[index].light = begin;
+        return index;
+    }
+
+    Bounds3 centroidBounds;
+    for (int i = begin; i < end; ++i)
+        centroidBounds = Union(centroidBounds, lights[i].bounds.Centroid());
+    int dim = centroidBounds.maxExtent();
+    int mid = (begin + end) / 2;
+    std::nth_element(lights.begin() + begin, lights.begin() + mid, lights.begin() + end,
+                     [dim](LightEntry& a, LightEntry& b) {
+                         const Vector3f ca = a.bounds.Centroid(), cb = b.bounds.Centroid();
+                         return ca[dim] < cb[dim];
+                     });
+
+    int left = recursiveBuild(begin, mid);
+    int right = recursiveBuild(mid, end);
+    LightBVHNode& node = nodes[index];
+    node.left = left;
+    node.right = right;
+    node.bounds = Union(nodes[left].bounds, nodes[right].bounds);
+    node.cone = Union(nodes[left].cone, nodes[right].cone);
+    node.phi = nodes[left].phi + nodes[right].phi;
+    return index;
+}
+
+/*
+**贡献估计 = phi * 发光面朝向p的余弦上界 * 着色面朝向光源的余弦上界 / 距离平方
+**余弦上界把法向锥的半角和包围盒对p的张角都减掉；发光面只向法向量所在的半球发光
+*/
+float LightBVH::importance(const LightBVHNode& node, const Vector3f& p, const Vector3f& N) const
+{
+    //cos(max(0, A - B))及其正弦
+    auto cosSubClamped = [](float sinA, float cosA, float sinB, float cosB) {
+        return cosA > cosB ? 1.0f : cosA * cosB + sinA * sinB;
+    };
+    auto sinSubClamped = [](float sinA, float cosA, float sinB, float cosB) {
+        return cosA > cosB ? 0.0f : sinA * cosB - cosA * sinB;
+    };
+    auto sinFromCos = [](float c) { return std::sqrt(std::max(0.0f, 1 - c * c)); };
+
+    Bounds3 bounds = node.bounds;
+    Vector3f pc = bounds.Centroid();
+    Vector3f d = p - pc;
+    float d2 = dotProduct(d, d);
+    float radius = bounds.Diagonal().norm() / 2;
+    d2 = std::max(d2, radius);
+    Vector3f wi = normalize(d);//光源指向p
+
+    //包围盒从p看过去的张角
+    float cosTheta_b = -1;
+    if (d2 > radius * radius)
+        cosTheta_b = std::sqrt(std::max(0.0f, 1 - radius * radius / d2));
+    float sinTheta_b = sinFromCos(cosTheta_b);
+
+    float cosTheta_o = node.cone.cosTheta, sinTheta_o = sinFromCos(cosTheta_o);
+    float cosTheta_w = dotProduct(node.cone.axis, wi), sinTheta_w = sinFromCos(cosTheta_w);
+    float cosTheta_x = cosSubClamped(sinTheta_w, cosTheta_w, sinTheta_o, cosTheta_o);
+    float sinTheta_x = sinSubClamped(sinTheta_w, cosTheta_w, sinTheta_o, cosTheta_o);
+    float cosTheta_p = cosSubClamped(sinTheta_x, cosTheta_x, sinTheta_b, cosTheta_b);
+    if (cosTheta_p <= 0)
+        return 0;
+
+    float cosTheta_i = -dotProduct(wi, N), sinTheta_i = sinFromCos(cosTheta_i);
+    float cosThetap_i = cosSubClamped(sinTheta_i, cosTheta_i, sinTheta_b, cosTheta_b);
+    return std::max(0.0f, node.phi * cosTheta_p * cosThetap_i / d2);
+}
+
+bool LightBVH::Sample(const Vector3f& p, const Vector3f& N, Intersection& pos, float& pdf) const
+{
+    if (nodes.empty())
+        return false;
+
+    //整条路径只用一个随机数u，每层选择后把u重新映射回[0,1)
+    float u = get_random_float();
+    int index = 0;
+    float pmf = 1;
+    while (nodes[index].light < 0) {
+        const LightBVHNode& node = nodes[index];
+        float ci[2] = {importance(nodes[node.left], p, N), importance(nodes[node.right], p, N)};
+        if (ci[0] == 0 && ci[1] == 0)
+            return false;
+        float p0 = ci[0] / (ci[0] + ci[1]);
+        if (u < p0) {
+            index = node.left;
+            pmf *= p0;
+            u = std::min(u / p0, 0.99999994f);
+        } else {
+            index = node.right;
+            pmf *= 1 - p0;
+            u = std::min((u - p0) / (1 - p0), 0.99999994f);
+        }
+    }
+    if (index == 0 && importance(nodes[0], p, N) == 0)
+        return false;
+
+    const LightEntry& light = lights[nodes[index].light];
+    light.obj->Sample(pos, pdf);
+    pos.emit = light.emit;
+    pdf *= pmf;
+    return true;
+}
@@ -0,0 +1,69 @@
+#ifndef RAYTRACING_LIGHTBVH_H
+#define RAYTRACING_LIGHTBVH_H
+#include <vector>
+#include "global.hpp"
+#include "Bounds3.hpp"
+#include "Intersection.hpp"
+#include "Object.hpp"
+
+/*
+**方向锥：以axis为轴、半角余弦为cosTheta的一组方向；cosTheta = kInfinity表示空锥，-1表示整个球面
+*/
+struct DirectionCone {
+    Vector3f axis = Vector3f(0, 0, 1);
+    float cosTheta = kInfinity;
+
+    DirectionCone() = default;
+    DirectionCone(const Vector3f& axis, float cosTheta) : axis(axis), cosTheta(cosTheta) {}
+
+    bool isEmpty() const { return cosTheta == kInfinity; }
+    static DirectionCone EntireSphere() { return DirectionCone(Vector3f(0, 0, 1), -1); }
+};
+
+DirectionCone Union(const DirectionCone& a, const DirectionCone& b);
+
+/*
+**一个发光体：网格的每个发光三角形(MeshFace)单独作为一个光源，其他发光物体整体作为一个光源
+**phi为发射功率的估计(亮度 * 面积)，cone为发光面法向量的范围
+*/
+struct LightEntry {
+    Object* obj;
+    Bounds3 bounds;
+    DirectionCone cone;
+    float phi;
+    Vector3f emit;
+};
+
+/*
+**光源BVH树的节点，按数组存放；light >= 0时为叶子，否则left、right为子节点下标
+*/
+struct LightBVHNode {
+    Bounds3 bounds;
+    DirectionCone cone;
+    float phi = 0;
+    int left = -1, right = -1;
+    int light = -1;
+};
+
+/*
+**光源BVH树：对场景中的全部发光体建立层次结构，节点记录包围盒、法向锥和总功率
+**采样时从根节点出发，按两个子节点对着色点的贡献估计(importance)随机选择一侧，直到叶子
+*/
+class LightBVH
+{
+public:
+    explicit LightBVH(const std::vector<Object*>& objects);
+
+    //对着色点p(法向量N)采样一个光源上的点，pdf为面积测度下的概率密度；所有光源都照不到p时返回false
+    bool Sample(const Vector3f& p, const Vector3f& N, Intersection& pos, float& pdf) const;
+    //着色点p处某个节点内光源贡献的保守估计，照不到时为0
+    float importance(const LightBVHNode& node, const Vector3f& p, const Vector3f& N) const;
+
+    std::vector<LightEntry> lights;
+    std::vector<LightBVHNode> nodes;//nodes[0]为根节点
+
+private:
+    int recursiveBuild(int begin, int end);
+};
+
+#endif //RAYTRACING_LIGHTBVH_H
@@ -21,6 +21,33 @@ public:
     virtual float getArea()=0;
     virtual void Sample(Intersection &pos, float &pdf)=0;
     virtual bool hasEmit()=0;
+    //整个物体共用的材质，没有统一材质的物体返回空
+    virtual Material* getMaterial() { return nullptr; }
+
+    uint32_t sceneId = UINT32_MAX;//在Scene::objects中的序号，由Scene::Add、Insert、Remove维护
+
+    //轻量求交：只有比hit.t更近时才更新hit并返回true；默认借助getIntersection实现
+    virtual bool intersectHit(const Ray& ray, Hit& hit)
+    {
+        Intersection inter = getIntersection(ray);
+        if (!inter.happened || inter.distance >= hit.t) return false;
+        hit.t = inter.distance;
+        hit.primId = 0;
+        hit.obj = this;
+        return true;
+    }
+    //任意命中：在(0, tMax)内有交点即返回true，不要求是最近的；默认借助intersectHit实现
+    virtual bool intersectAny(const Ray& ray, float tMax)
+    {
+        Hit hit;
+        hit.t = tMax;
+        return intersectHit(ray, hit);
+    }
+    //由intersectHit得到的最近命中计算完整的相交数据
+    virtual Intersection getSurfaceInteraction(const Ray& ray, const Hit& hit)
+    {
+        return getIntersection(ray);
+    }
 };
 
 
@@ -0,0 +1,440 @@
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "OutOfCoreMesh.hpp"
+#include "Triangle.hpp"
+
+static constexpr char kMagic[8] = {'O', 'O', 'C', 'M', 'E', 'S', 'H', '1'};
+static constexpr size_t kPageSize = 4096;
+
+//页文件头：簇目录放在文件末尾，directoryOffset指向它
+struct PageFileHeader {
+    char magic[8];
+    uint32_t numClusters;
+    uint32_t pad;
+    uint64_t directoryOffset;
+};
+
+void ClusterCache::resize(size_t clusterCount)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    slots = std::make_unique<Slot[]>(clusterCount);
+    ring.clear();
+    hand = 0;
+    residentBytes = 0;
+}
+
+bool ClusterCache::acquire(uint32_t id, const char* data, size_t bytes)
+{
+    //已驻留：只设置访问位，访问位已设置时不写，避免各线程反复写同一个缓存行
+    Slot& slot = slots[id];
+    if (slot.resident.load(std::memory_order_acquire)) {
+        if (!slot.referenced.load(std::memory_order_relaxed)) slot.referenced.store(true, std::memory_order_relaxed);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (slot.resident.load(std::memory_order_relaxed)) {
+        slot.referenced.store(true, std::memory_order_relaxed);
+        return false;
+    }
+
+    //一次性调入簇的全部页，避免在遍历中零散缺页；读到的值写入volatile变量，读取不会被优化掉
+    madvise((void*)data, bytes, MADV_WILLNEED);
+    char touched = 0;
+    for (size_t i = 0; i < bytes; i += kPageSize) touched ^= data[i];
+    volatile char sink = touched;
+    (void)sink;
+
+    slot.data = data;
+    slot.bytes = bytes;
+    slot.referenced.store(true, std::memory_order_relaxed);
+    slot.resident.store(true, std::memory_order_release);
+    ring.push_back(id);
+    residentBytes += bytes;
+    ++pageIns;
+
+    //CLOCK：访问位已设置的簇清除访问位后跳过，未设置的释放；刚调入的簇不释放
+    while (residentBytes > memoryCap && ring.size() > 1) {
+        if (hand >= ring.size()) hand = 0;
+        uint32_t victim = ring[hand];
+        Slot& e = slots[victim];
+        if (victim == id || e.referenced.exchange(false, std::memory_order_relaxed)) {
+            ++hand;
+            continue;
+        }
+        e.resident.store(false, std::memory_order_release);
+        madvise((void*)e.data, e.bytes, MADV_DONTNEED);
+        residentBytes -= e.bytes;
+        ring[hand] = ring.back();
+        ring.pop_back();
+        ++evictions;
+    }
+    return true;
+}
+
+void ClusterCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (uint32_t id : ring) {
+        Slot& e = slots[id];
+        e.resident.store(false, std::memory_order_release);
+        e.referenced.store(false, std::memory_order_relaxed);
+        madvise((void*)e.data, e.bytes, MADV_DONTNEED);
+    }
+    ring.clear();
+    hand = 0;
+    residentBytes = 0;
+}
+
+namespace {
+
+//析构时关闭的文件描述符
+struct FileDescriptor {
+    int fd;
+    ~FileDescriptor() { if (fd >= 0) close(fd); }
+};
+
+}
+
+MappedFile::MappedFile(const std::string& path)
+{
+    FileDescriptor file{open(path.c_str(), O_RDONLY)};
+    if (file.fd < 0) throw std::runtime_error("cannot open page file " + path);
+    struct stat st;
+    if (fstat(file.fd, &st) != 0) throw std::runtime_error("cannot stat page file " + path);
+    size = st.st_size;
+    if (size == 0) throw std::runtime_error(path + " is empty");
+    void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file.fd, 0);
+    if (p == MAP_FAILED) throw std::runtime_error("cannot map page file " + path);
+    data = (const char*)p;
+}
+
+MappedFile::~MappedFile()
+{
+    if (data) munmap((void*)data, size);
+}
+
+/*
+**把簇对应的BVH子树展平成深度优先的ClusterNode数组，叶子中的三角形以9个float写入tris
+*/
+static uint32_t flattenCluster(BVHAccel* bvh, BVHBuildNode* node, std::vector<ClusterNode>& nodes, std::vector<float>& tris)
+{
+    node = bvh->expand(node);
+    uint32_t index = nodes.size();
+    nodes.emplace_back();
+    ClusterNode n;
+    const Bounds3& b = node->bounds;
+    for (int a = 0; a < 3; ++a) {
+        n.bmin[a] = b.pMin[a];
+        n.bmax[a] = b.pMax[a];
+    }
+    if (node->left == nullptr && node->right == nullptr) {
+        auto face = static_cast<MeshFace*>(node->object);
+        n.offset = tris.size() / 9;
+        n.nPrimitives = 1;
+        for (auto v : {&face->v0(), &face->v1(), &face->v2()})
+            tris.insert(tris.end(), {v->x, v->y, v->z});
+        nodes[index] = n;
+        return index;
+    }
+    n.nPrimitives = 0;
+    flattenCluster(bvh, node->left, nodes, tris);
+    n.offset = flattenCluster(bvh, node->right, nodes, tris);
+    nodes[index] = n;
+    return index;
+}
+
+static void collectClusterRoots(BVHAccel* bvh, BVHBuildNode* node, int clusterSize, std::vector<BVHBuildNode*>& roots)
+{
+    if (node->nPrimitives <= clusterSize) {
+        roots.push_back(node);
+        return;
+    }
+    node = bvh->expand(node);
+    collectClusterRoots(bvh, node->left, clusterSize, roots);
+    collectClusterRoots(bvh, node->right, clusterSize, roots);
+}
+
+void OutOfCoreMesh::write(MeshTriangle& mesh, const std::string& path, int clusterSize)
+{
+    std::vector<BVHBuildNode*> roots;
+    collectClusterRoots(mesh.bvh, mesh.bvh->root, clusterSize, roots);
+
+    FILE* fp = fopen(path.c_str(), "wb");
+    if (!fp) throw std::runtime_error("cannot create page file " + path);
+
+    PageFileHeader header{};
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.numClusters = roots.size();
+    fwrite(&header, sizeof(header), 1, fp);
+
+    std::vector<ClusterInfo> directory;
+    uint64_t offset = kPageSize;
+    for (auto root : roots) {
+        std::vector<ClusterNode> nodes;
+        std::vector<float> tris;
+        flattenCluster(mesh.bvh, root, nodes, tris);
+
+        ClusterInfo info{};
+        const Bounds3& b = root->bounds;
+        for (int a = 0; a < 3; ++a) {
+            info.bmin[a] = b.pMin[a];
+            info.bmax[a] = b.pMax[a];
+        }
+        info.area = root->area;
+        info.numTriangles = tris.size() / 9;
+        info.numNodes = nodes.size();
+        info.offset = offset;
+        info.bytes = nodes.size() * sizeof(ClusterNode) + tris.size() * sizeof(float);
+        directory.push_back(info);
+
+        fseek(fp, offset, SEEK_SET);
+        fwrite(nodes.data(), sizeof(ClusterNode), nodes.size(), fp);
+        fwrite(tris.data(), sizeof(float), tris.size(), fp);
+        offset += (info.bytes + kPageSize - 1) / kPageSize * kPageSize;//下一个簇从新的页开始
+    }
+
+    header.directoryOffset = offset;
+    fseek(fp, offset, SEEK_SET);
+    fwrite(directory.data(), sizeof(ClusterInfo), directory.size(), fp);
+    fseek(fp, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, fp);
+    fclose(fp);
+    printf(" - Out-of-core page file %s: %zu clusters\n", path.c_str(), roots.size());
+}
+
+OutOfCoreMesh::OutOfCoreMesh(const std::string& path, Material* mt, size_t memoryCap)
+    : m(mt), cache(memoryCap), file(path)
+{
+    PageFileHeader header;
+    if (file.size < sizeof(header)) throw std::runtime_error(path + " is not an out-of-core page file");
+    memcpy(&header, file.data, sizeof(header));
+    if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0)
+        throw std::runtime_error(path + " is not an out-of-core page file");
+
+    //目录和每个簇都必须落在文件内，簇的大小与节点数、三角形数一致
+    uint64_t directoryBytes = uint64_t(header.numClusters) * sizeof(ClusterInfo);
+    if (header.numClusters == 0 || header.directoryOffset > file.size || directoryBytes > file.size - header.directoryOffset)
+        throw std::runtime_error(path + ": bad cluster directory");
+    clusters.resize(header.numClusters);
+    memcpy(clusters.data(), file.data + header.directoryOffset, directoryBytes);
+    for (auto& info : clusters) {
+        uint64_t bytes = uint64_t(info.numNodes) * sizeof(ClusterNode) + uint64_t(info.numTriangles) * 9 * sizeof(float);
+        if (info.numNodes == 0 || info.bytes != bytes || info.offset > file.size || info.bytes > file.size - info.offset)
+            throw std::runtime_error(path + ": corrupt cluster directory entry");
+    }
+    validated = std::make_unique<std::atomic<bool>[]>(clusters.size());
+    cache.resize(clusters.size());
+    madvise((void*)file.data, file.size, MADV_RANDOM);//按簇访问，不需要内核预读
+
+    proxies.reserve(clusters.size());
+    std::vector<Object*> ptrs;
+    for (uint32_t id = 0; id < clusters.size(); ++id) {
+        proxies.emplace_back(this, id);
+        area += clusters[id].area;
+    }
+    for (auto& proxy : proxies) {
+        ptrs.push_back(&proxy);
+        bounding_box = Union(bounding_box, proxy.getBounds());
+    }
+    bvh = new BVHAccel(ptrs);
+}
+
+OutOfCoreMesh::~OutOfCoreMesh()
+{
+    delete bvh;
+}
+
+const char* OutOfCoreMesh::clusterData(uint32_t id)
+{
+    const char* data = file.data + clusters[id].offset;
+    cache.acquire(id, data, clusters[id].bytes);
+    //映射是只读的，检查一次即可；多个线程同时检查同一个簇没有影响
+    if (!validated[id].load(std::memory_order_acquire)) {
+        validateCluster(id, data);
+        validated[id].store(true, std::memory_order_release);
+    }
+    return data;
+}
+
+/*
+**内部节点的左孩子为下一个节点，右孩子在左孩子之后，孩子的序号总是大于父节点，遍历一定终止
+**按序号顺序传递每个节点的最大深度，遍历时栈中最多有深度+1个节点
+*/
+void OutOfCoreMesh::validateCluster(uint32_t id, const char* data) const
+{
+    const ClusterInfo& info = clusters[id];
+    const ClusterNode* nodes = (const ClusterNode*)data;
+    std::vector<uint8_t> depth(info.numNodes, 0);
+    for (uint32_t i = 0; i < info.numNodes; ++i) {
+        const ClusterNode& node = nodes[i];
+        bool ok;
+        if (node.nPrimitives == 0) {
+            ok = i + 1 < info.numNodes && node.offset > i + 1 && node.offset < info.numNodes &&
+                 depth[i] + 2 <= kClusterStackSize;
+            if (ok) {
+                depth[i + 1] = std::max<uint8_t>(depth[i + 1], depth[i] + 1);
+                depth[node.offset] = std::max<uint8_t>(depth[node.offset], depth[i] + 1);
+            }
+        } else {
+            ok = uint64_t(node.offset) + node.nPrimitives <= info.numTriangles;
+        }
+        if (!ok) throw std::runtime_error("out-of-core cluster " + std::to_string(id) + ": corrupt BVH node " + std::to_string(i));
+    }
+}
+
+Bounds3 OutOfCoreMesh::Cluster::getBounds()
+{
+    const ClusterInfo& info = mesh->clusters[id];
+    return Bounds3(Vector3f(info.bmin[0], info.bmin[1], info.bmin[2]),
+                   Vector3f(info.bmax[0], info.bmax[1], info.bmax[2]));
+}
+
+Intersection OutOfCoreMesh::Cluster::getIntersection(Ray ray)
+{
+    Hit hit;
+    if (!intersectHit(ray, hit))
+        return Intersection();
+    return getSurfaceInteraction(ray, hit);
+}
+
+bool OutOfCoreMesh::Cluster::intersectHit(const Ray& ray, Hit& hit)
+{
+    float tPrev = hit.t;
+    mesh->intersectCluster(id, mesh->clusterData(id), ray, hit);
+    return hit.t < tPrev;
+}
+
+Intersection OutOfCoreMesh::Cluster::getSurfaceInteraction(const Ray& ray, const Hit& hit)
+{
+    const ClusterInfo& info = mesh->clusters[id];
+    const float* t = (const float*)(mesh->clusterData(id) + info.numNodes * sizeof(ClusterNode)) + hit.primId * 9;
+    Vector3f v0(t[0], t[1], t[2]), v1(t[3], t[4], t[5]), v2(t[6], t[7], t[8]);
+    Intersection inter;
+    inter.happened = true;
+    inter.distance = hit.t;
+    inter.coords = ray(hit.t);
+    inter.normal = normalize(crossProduct(v1 - v0, v2 - v0));
+    inter.m = mesh->m;
+    inter.obj = mesh;
+    return inter;
+}
+
+/*
+**按面积在簇内选一个三角形再均匀采样，pdf为1/簇面积(与BVHAccel::getSample的约定一致)
+*/
+void OutOfCoreMesh::Cluster::Sample(Intersection& pos, float& pdf)
+{
+    const ClusterInfo& info = mesh->clusters[id];
+    const char* data = mesh->clusterData(id);
+    const float* tris = (const float*)(data + info.numNodes * sizeof(ClusterNode));
+
+    float p = get_random_float() * info.area;
+    Vector3f v0, v1, v2;
+    for (uint32_t k = 0; k < info.numTriangles; ++k) {
+        const float* t = tris + k * 9;
+        v0 = Vector3f(t[0], t[1], t[2]);
+        v1 = Vector3f(t[3], t[4], t[5]);
+        v2 = Vector3f(t[6], t[7], t[8]);
+        p -= crossProduct(v1 - v0, v2 - v0).norm() * 0.5f;
+        if (p <= 0) break;
+    }
+    float x = std::sqrt(get_random_float()), y = get_random_float();
+    pos.coords = v0 * (1.0f - x) + v1 * (x * (1.0f - y)) + v2 * (x * y);
+    pos.normal = normalize(crossProduct(v1 - v0, v2 - v0));
+    pdf = 1.0f / info.area;
+}
+
+void OutOfCoreMesh::intersectCluster(uint32_t id, const char* data, const Ray& ray, Hit& closest)
+{
+    const ClusterInfo& info = clusters[id];
+    const ClusterNode* nodes = (const ClusterNode*)data;
+    const float* tris = (const float*)(data + info.numNodes * sizeof(ClusterNode));
+    Vector3f invDir = ray.direction_inv;
+    std::array<int, 3> dirIsNeg = {int(ray.direction.x > 0), int(ray.direction.y > 0), int(ray.direction.z > 0)};
+
+    uint32_t stack[kClusterStackSize];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const ClusterNode& node = nodes[stack[--top]];
+        Bounds3 b(Vector3f(node.bmin[0], node.bmin[1], node.bmin[2]), Vector3f(node.bmax[0], node.bmax[1], node.bmax[2]));
+        if (!b.IntersectP(ray, invDir, dirIsNeg)) continue;
+        if (node.nPrimitives == 0) {
+            stack[top++] = node.offset;
+            stack[top++] = &node - nodes + 1;
+            continue;
+        }
+        for (uint32_t k = 0; k < node.nPrimitives; ++k) {
+            const float* t = tris + (node.offset + k) * 9;
+            Vector3f v0(t[0], t[1], t[2]), v1(t[3], t[4], t[5]), v2(t[6], t[7], t[8]);
+            double tHit, u, v;
+            if (!intersectTriangle(v0, v1, v2, ray, tHit, u, v) || tHit >= closest.t) continue;
+            closest.t = tHit;
+            closest.primId = node.offset + k;
+            closest.b1 = u;
+            closest.b2 = v;
+            closest.obj = &proxies[id];
+        }
+    }
+}
+
+Intersection OutOfCoreMesh::getIntersection(Ray ray)
+{
+    return bvh->Intersect(ray);
+}
+
+void OutOfCoreMesh::Sample(Intersection& pos, float& pdf)
+{
+    bvh->Sample(pos, pdf);
+    pos.emit = m->getEmission();
+}
+
+void OutOfCoreMesh::collectClusters(BVHBuildNode* node, const Ray& ray, const Vector3f& invDir,
+                                    const std::array<int, 3>& dirIsNeg, std::vector<uint32_t>& ids) const
+{
+    if (!node->bounds.IntersectP(ray, invDir, dirIsNeg)) return;
+    if (node->left == nullptr && node->right == nullptr) {
+        ids.push_back(static_cast<Cluster*>(node->object)->id);
+        return;
+    }
+    collectClusters(node->left, ray, invDir, dirIsNeg, ids);
+    collectClusters(node->right, ray, invDir, dirIsNeg, ids);
+}
+
+void OutOfCoreMesh::intersect(const std::vector<Ray>& rays, std::vector<Intersection>& hits)
+{
+    std::vector<Hit> closest(rays.size());
+    std::vector<std::vector<uint32_t>> queued(clusters.size());//每个非驻留簇上排队的光线
+    std::vector<uint32_t> ids;
+    for (uint32_t r = 0; r < rays.size(); ++r) {
+        const Ray& ray = rays[r];
+        std::array<int, 3> dirIsNeg = {int(ray.direction.x > 0), int(ray.direction.y > 0), int(ray.direction.z > 0)};
+        ids.clear();
+        collectClusters(bvh->root, ray, ray.direction_inv, dirIsNeg, ids);
+        for (auto id : ids) {
+            if (cache.resident(id))
+                intersectCluster(id, clusterData(id), ray, closest[r]);
+            else
+                queued[id].push_back(r);
+        }
+    }
+
+    //每个簇只调页一次，处理所有排在它上面的光线
+    for (uint32_t id = 0; id < clusters.size(); ++id) {
+        if (queued[id].empty()) continue;
+        const char* data = clusterData(id);
+        for (auto r : queued[id])
+            intersectCluster(id, data, rays[r], closest[r]);
+    }
+
+    //所有簇处理完后才为每条光线的最近交点计算一次表面信息
+    hits.assign(rays.size(), Intersection());
+    for (uint32_t r = 0; r < rays.size(); ++r)
+        if (closest[r].happened())
+            hits[r] = closest[r].obj->getSurfaceInteraction(rays[r], closest[r]);
+}
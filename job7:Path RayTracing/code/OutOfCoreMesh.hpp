@@ -0,0 +1,162 @@
+#ifndef RAYTRACING_OUTOFCOREMESH_H
+#define RAYTRACING_OUTOFCOREMESH_H
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "BVH.hpp"
+#include "Material.hpp"
+#include "Object.hpp"
+
+class MeshTriangle;
+
+/*
+**页文件中一个簇的目录项：簇包围盒、面积，以及簇内BVH节点和三角形在文件中的位置(按页对齐)
+*/
+struct ClusterInfo {
+    float bmin[3], bmax[3];
+    float area;
+    uint32_t numTriangles;
+    uint32_t numNodes;
+    uint32_t pad;
+    uint64_t offset;
+    uint64_t bytes;
+};
+
+/*
+**簇内的底层BVH节点，深度优先排列：左孩子紧跟在父节点之后
+**内部节点的offset为右孩子序号；叶子(nPrimitives > 0)的offset为第一个三角形的序号
+*/
+struct ClusterNode {
+    float bmin[3], bmax[3];
+    uint32_t offset;
+    uint32_t nPrimitives;
+};
+
+/*
+**驻留缓存：记录哪些簇的页正在内存中，驻留总量超过memoryCap时按CLOCK算法(近似LRU)释放近期没有访问的簇
+**访问已驻留的簇只读写该簇的原子标志，不加锁；只有调页和释放时才持有mutex，渲染线程不会在每次访问簇时串行
+**释放只是madvise(MADV_DONTNEED)让内核丢弃页，其他线程若仍在读这个簇只会重新缺页，不需要引用计数
+*/
+class ClusterCache {
+public:
+    explicit ClusterCache(size_t memoryCap) : memoryCap(memoryCap) {}
+
+    //设置簇的数目，在第一次acquire之前调用
+    void resize(size_t clusterCount);
+    //访问簇id，不在内存中时预先调入它的全部页；返回true表示这次访问发生了调页
+    bool acquire(uint32_t id, const char* data, size_t bytes);
+    bool resident(uint32_t id) const { return slots[id].resident.load(std::memory_order_acquire); }
+    //释放全部驻留的簇(统计数据不变)
+    void clear();
+
+    size_t memoryCap;
+    size_t residentBytes = 0;//以下由mutex保护
+    size_t pageIns = 0, evictions = 0;
+
+private:
+    struct Slot {
+        std::atomic<bool> resident{false};
+        std::atomic<bool> referenced{false};//CLOCK的访问位，指针扫过时清除
+        const char* data = nullptr;
+        size_t bytes = 0;
+    };
+    std::unique_ptr<Slot[]> slots;
+    std::mutex mutex;
+    std::vector<uint32_t> ring;//驻留的簇，CLOCK指针hand在其中循环
+    size_t hand = 0;
+};
+
+/*
+**只读映射整个文件，析构时解除映射；文件描述符只在建立映射期间打开
+*/
+struct MappedFile {
+    explicit MappedFile(const std::string& path);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data = nullptr;
+    size_t size = 0;
+};
+
+/*
+**外存网格：几何和底层BVH存放在本地磁盘的页文件中并通过mmap映射，只有簇目录和顶层BVH常驻内存
+**单条光线可直接求交(按需调页)；批量求交会把需要非驻留簇的光线排队，每个簇只调页一次
+*/
+class OutOfCoreMesh : public Object
+{
+public:
+    //把已加载的MeshTriangle按其BVH子树切分成不超过clusterSize个三角形的簇，写入页文件(离线转换)
+    static void write(MeshTriangle& mesh, const std::string& path, int clusterSize = 256);
+
+    //页文件格式不对、被截断或目录越界时抛出std::runtime_error；簇内的BVH在第一次调入时检查，损坏时求交抛出同样的异常
+    OutOfCoreMesh(const std::string& path, Material* mt = new Material(), size_t memoryCap = size_t(256) << 20);
+    ~OutOfCoreMesh();
+    OutOfCoreMesh(const OutOfCoreMesh&) = delete;
+    OutOfCoreMesh& operator=(const OutOfCoreMesh&) = delete;
+
+    //批量求交：先在已驻留的簇中求交，其余(光线, 簇)对按簇排队，再逐簇调页处理
+    void intersect(const std::vector<Ray>& rays, std::vector<Intersection>& hits);
+
+    bool intersect(const Ray& ray) override { return true; }
+    bool intersect(const Ray& ray, float& tnear, uint32_t& index) const override { return false; }
+    Intersection getIntersection(Ray ray) override;
+    //命中记录的obj为簇(见Cluster)，作为场景中的物体时由簇计算表面信息
+    bool intersectHit(const Ray& ray, Hit& hit) override { return bvh->IntersectHit(ray, hit); }
+    bool intersectAny(const Ray& ray, float tMax) override { return bvh->IntersectP(ray, tMax); }
+    void getSurfaceProperties(const Vector3f& P, const Vector3f& I, const uint32_t& index,
+                              const Vector2f& uv, Vector3f& N, Vector2f& st) const override {}
+    Vector3f evalDiffuseColor(const Vector2f&) const override { return Vector3f(0.5, 0.5, 0.5); }
+    Bounds3 getBounds() override { return bounding_box; }
+    float getArea() override { return area; }
+    void Sample(Intersection& pos, float& pdf) override;
+    bool hasEmit() override { return m->hasEmission(); }
+    Material* getMaterial() override { return m; }
+
+    //顶层BVH的叶子：一个簇
+    class Cluster : public Object
+    {
+    public:
+        OutOfCoreMesh* mesh;
+        uint32_t id;
+        Cluster(OutOfCoreMesh* mesh, uint32_t id) : mesh(mesh), id(id) {}
+
+        bool intersect(const Ray& ray) override { return true; }
+        bool intersect(const Ray& ray, float& tnear, uint32_t& index) const override { return false; }
+        Intersection getIntersection(Ray ray) override;
+        //命中记录的obj为簇本身、primId为簇内三角形序号
+        bool intersectHit(const Ray& ray, Hit& hit) override;
+        Intersection getSurfaceInteraction(const Ray& ray, const Hit& hit) override;
+        void getSurfaceProperties(const Vector3f& P, const Vector3f& I, const uint32_t& index,
+                                  const Vector2f& uv, Vector3f& N, Vector2f& st) const override {}
+        Vector3f evalDiffuseColor(const Vector2f&) const override { return Vector3f(0.5, 0.5, 0.5); }
+        Bounds3 getBounds() override;
+        float getArea() override { return mesh->clusters[id].area; }
+        void Sample(Intersection& pos, float& pdf) override;
+        bool hasEmit() override { return mesh->m->hasEmission(); }
+    };
+
+    Material* m;
+    Bounds3 bounding_box;
+    float area = 0;
+    ClusterCache cache;
+    std::vector<ClusterInfo> clusters;//簇目录，常驻内存
+    std::vector<Cluster> proxies;
+    BVHAccel* bvh = nullptr;//顶层BVH，叶子为簇
+
+private:
+    static constexpr int kClusterStackSize = 64;//簇内遍历栈的大小，簇内BVH的深度必须小于它
+    const char* clusterData(uint32_t id);//返回簇数据的地址，必要时调页；簇第一次被访问时检查它的BVH
+    //检查簇内每个节点的孩子和三角形范围、以及深度，页文件损坏时抛出std::runtime_error而不是越界读取
+    void validateCluster(uint32_t id, const char* data) const;
+    void intersectCluster(uint32_t id, const char* data, const Ray& ray, Hit& closest);
+    void collectClusters(BVHBuildNode* node, const Ray& ray, const Vector3f& invDir,
+                         const std::array<int, 3>& dirIsNeg, std::vector<uint32_t>& ids) const;
+
+    std::unique_ptr<std::atomic<bool>[]> validated;//每个簇是否已通过validateCluster
+    MappedFile file;//整个页文件的映射
+};
+
+#endif //RAYTRACING_OUTOFCOREMESH_H
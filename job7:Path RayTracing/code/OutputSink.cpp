@@ -0,0 +1,104 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <unistd.h>
+#include "OutputSink.hpp"
+#include "global.hpp"
+
+void PPMSink::write(int width, int height, const std::vector<Vector3f>& framebuffer)
+{
+    FILE* fp = fopen(path.c_str(), "wb");
+    if (!fp) throw std::runtime_error("cannot open output file " + path);
+    (void)fprintf(fp, "P6\n%d %d\n255\n", width, height);
+    //每行转换后一次写出
+    std::vector<unsigned char> row(3 * width);
+    for (int j = 0; j < height; ++j) {
+        for (int i = 0; i < width; ++i) {
+            const Vector3f& c = framebuffer[j * width + i];
+            row[3 * i] = toneMap(c.x);
+            row[3 * i + 1] = toneMap(c.y);
+            row[3 * i + 2] = toneMap(c.z);
+        }
+        fwrite(row.data(), 1, row.size(), fp);
+    }
+    fclose(fp);
+}
+
+void writeSampleCounts(const std::string& path, int width, int height, const std::vector<uint32_t>& samples)
+{
+    FILE* fp = fopen(path.c_str(), "wb");
+    if (!fp) throw std::runtime_error("cannot open output file " + path);
+    (void)fprintf(fp, "P5\n%d %d\n65535\n", width, height);
+    std::vector<unsigned char> row(2 * width);
+    for (int j = 0; j < height; ++j) {
+        for (int i = 0; i < width; ++i) {
+            uint32_t s = std::min<uint32_t>(samples[j * width + i], 65535);
+            row[2 * i] = (unsigned char)(s >> 8);
+            row[2 * i + 1] = (unsigned char)(s & 0xff);
+        }
+        fwrite(row.data(), 1, row.size(), fp);
+    }
+    fclose(fp);
+}
+
+StreamingImageSink::~StreamingImageSink()
+{
+    if (fd >= 0) close(fd);
+}
+
+void StreamingImageSink::begin(int w, int h)
+{
+    width = w;
+    height = h;
+    if (fd >= 0) close(fd);
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) throw std::runtime_error("cannot open output file " + path);
+    //PFM的比例因子为负表示小端字节序
+    uint32_t one = 1;
+    bool little = *reinterpret_cast<unsigned char*>(&one) == 1;
+    char header[64];
+    int n = floatOutput ? snprintf(header, sizeof(header), "PF\n%d %d\n%s\n", w, h, little ? "-1.0" : "1.0")
+                        : snprintf(header, sizeof(header), "P6\n%d %d\n255\n", w, h);
+    headerSize = n;
+    size_t pixelSize = floatOutput ? 3 * sizeof(float) : 3;
+    //先把文件扩展到最终大小(稀疏文件)，之后各图块按偏移写入
+    if (write(fd, header, n) != n || ftruncate(fd, off_t(headerSize + pixelSize * size_t(w) * h)) != 0)
+        throw std::runtime_error("cannot write output file " + path);
+}
+
+void StreamingImageSink::writeTile(const TileRect& rect, const std::vector<Vector3f>& tile)
+{
+    int tileWidth = rect.x1 - rect.x0;
+    std::vector<unsigned char> row(tileWidth * (floatOutput ? 3 * sizeof(float) : 3));
+    for (int j = rect.y0; j < rect.y1; ++j) {
+        const Vector3f* src = &tile[(j - rect.y0) * tileWidth];
+        off_t offset;
+        if (floatOutput) {
+            for (int i = 0; i < tileWidth; ++i) {
+                float rgb[3] = {src[i].x, src[i].y, src[i].z};
+                memcpy(&row[i * sizeof(rgb)], rgb, sizeof(rgb));
+            }
+            offset = off_t(headerSize + (size_t(height - 1 - j) * width + rect.x0) * 3 * sizeof(float));
+        } else {
+            for (int i = 0; i < tileWidth; ++i) {
+                row[3 * i] = toneMap(src[i].x);
+                row[3 * i + 1] = toneMap(src[i].y);
+                row[3 * i + 2] = toneMap(src[i].z);
+            }
+            offset = off_t(headerSize + (size_t(j) * width + rect.x0) * 3);
+        }
+        if (pwrite(fd, row.data(), row.size(), offset) != ssize_t(row.size()))
+            throw std::runtime_error("cannot write output file " + path);
+    }
+}
+
+void StreamingImageSink::end()
+{
+    if (fd >= 0 && close(fd) != 0) {
+        fd = -1;
+        throw std::runtime_error("cannot write output file " + path);
+    }
+    fd = -1;
+}
@@ -0,0 +1,84 @@
+#ifndef RAYTRACING_OUTPUTSINK_H
+#define RAYTRACING_OUTPUTSINK_H
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "Vector.hpp"
+#include "global.hpp"
+
+/*
+**渲染结果的输出目标：渲染正常完成后由渲染线程调用一次write
+**framebuffer按行存储width * height个像素的线性辐射度
+*/
+class OutputSink
+{
+public:
+    virtual ~OutputSink() = default;
+    virtual void write(int width, int height, const std::vector<Vector3f>& framebuffer) = 0;
+};
+
+//图像中的一个图块[x0, x1) x [y0, y1)
+struct TileRect
+{
+    int x0, y0, x1, y1;
+};
+
+//线性辐射度到8位输出值：截断到[0, 1]后做gamma 0.6校正
+inline unsigned char toneMap(float v)
+{
+    return (unsigned char)(255 * std::pow(clamp(0, 1, v), 0.6f));
+}
+
+/*
+**写出二进制PPM(P6)，像素值截断到[0, 1]后做gamma 0.6校正
+*/
+class PPMSink : public OutputSink
+{
+public:
+    explicit PPMSink(std::string path = "binary.ppm") : path(std::move(path)) {}
+    void write(int width, int height, const std::vector<Vector3f>& framebuffer) override;
+
+    std::string path;
+};
+
+/*
+**逐图块输出：默认模式每完成一个图块就交给TileSink，渲染过程中不保存整幅图像，内存只与同时渲染的图块数有关
+**begin时创建完整大小的文件，writeTile按像素在文件中的位置直接写入(pwrite)，图块完成的先后顺序不影响结果
+**writeTile可能在多个线程中同时调用；出错时抛出std::runtime_error
+*/
+class TileSink
+{
+public:
+    virtual ~TileSink() = default;
+    virtual void begin(int width, int height) = 0;
+    virtual void writeTile(const TileRect& rect, const std::vector<Vector3f>& tile) = 0;
+    virtual void end() = 0;
+};
+
+/*
+**扫描线格式的逐图块输出：float为true时写PFM(每通道32位浮点的线性辐射度，行从下到上)，
+**否则写与PPMSink逐字节相同的8位PPM
+*/
+class StreamingImageSink : public TileSink
+{
+public:
+    StreamingImageSink(std::string path, bool floatOutput) : path(std::move(path)), floatOutput(floatOutput) {}
+    ~StreamingImageSink() override;
+
+    void begin(int width, int height) override;
+    void writeTile(const TileRect& rect, const std::vector<Vector3f>& tile) override;
+    void end() override;
+
+    std::string path;
+    bool floatOutput;
+
+private:
+    int fd = -1;
+    int width = 0, height = 0;
+    size_t headerSize = 0;
+};
+
+//把每个像素的样本数写成16位二进制PGM(P5，大端，超过65535的截断)，用于查看限时渲染中样本的分布
+void writeSampleCounts(const std::string& path, int width, int height, const std::vector<uint32_t>& samples);
+
+#endif //RAYTRACING_OUTPUTSINK_H
@@ -0,0 +1,119 @@
+#include <algorithm>
+#include <cmath>
+#include "PathGuide.hpp"
+#include "global.hpp"
+
+PathGuide::PathGuide(float cellSize, size_t capacity)
+    : cellSize(cellSize), cells(new Cell[capacity]), capacity(capacity)
+{
+    for (size_t i = 0; i < capacity; ++i)
+        for (auto& h : cells[i].histogram) h.store(0, std::memory_order_relaxed);
+}
+
+uint64_t PathGuide::cellKey(const Vector3f& p) const
+{
+    auto quantize = [this](float x) {
+        return uint64_t(int64_t(std::floor(x / cellSize)) + (1 << 20)) & 0x1FFFFF;
+    };
+    return (uint64_t(1) << 63) | (quantize(p.x) << 42) | (quantize(p.y) << 21) | quantize(p.z);
+}
+
+PathGuide::Cell* PathGuide::find(uint64_t key, bool insert) const
+{
+    //splitmix64
+    uint64_t h = key;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    h ^= h >> 31;
+
+    for (int probe = 0; probe < maxProbes; ++probe) {
+        Cell& cell = cells[(h + probe) % capacity];
+        uint64_t k = cell.key.load(std::memory_order_acquire);
+        if (k == key)
+            return &cell;
+        if (k == 0) {
+            if (!insert)
+                return nullptr;
+            uint64_t expected = 0;
+            if (cell.key.compare_exchange_strong(expected, key, std::memory_order_acq_rel) || expected == key)
+                return &cell;
+        }
+    }
+    return nullptr;
+}
+
+int PathGuide::binIndex(const Vector3f& wi)
+{
+    float phi = std::atan2(wi.y, wi.x);
+    if (phi < 0) phi += 2 * M_PI;
+    int iz = std::min(ThetaBins - 1, std::max(0, int((wi.z + 1) * 0.5f * ThetaBins)));
+    int ip = std::min(PhiBins - 1, int(phi / (2 * M_PI) * PhiBins));
+    return iz * PhiBins + ip;
+}
+
+void PathGuide::record(const Vector3f& p, const Vector3f& wi, float Li, float pdf)
+{
+    if (!training || pdf <= 0 || !(Li > 0))
+        return;
+    Cell* cell = find(cellKey(p), true);
+    if (!cell)
+        return;
+    //定点数的整数加法与顺序无关，多个线程并发记录时直方图与单线程逐位相同
+    float value = std::min(Li / pdf, MaxRecord);
+    cell->histogram[binIndex(wi)].fetch_add(uint64_t(value * FixedScale), std::memory_order_relaxed);
+    cell->count.fetch_add(1, std::memory_order_relaxed);
+}
+
+/*
+**直方图归一化成CDF；每个bin加上平均值的1%，避免记录中没有出现过的方向概率为0
+*/
+void PathGuide::update()
+{
+    for (size_t i = 0; i < capacity; ++i) {
+        Cell& cell = cells[i];
+        if (cell.key.load(std::memory_order_relaxed) == 0 || cell.count.load(std::memory_order_relaxed) < minSamples)
+            continue;
+        float total = 0;
+        for (auto& h : cell.histogram) total += h.load(std::memory_order_relaxed) / FixedScale;
+        if (!(total > 0))
+            continue;
+        float floor = 0.01f * total / Bins, sum = 0;
+        for (int b = 0; b < Bins; ++b) {
+            sum += cell.histogram[b].load(std::memory_order_relaxed) / FixedScale + floor;
+            cell.cdf[b] = sum;
+        }
+        for (int b = 0; b < Bins; ++b) cell.cdf[b] /= sum;
+        cell.cdf[Bins - 1] = 1;
+        cell.ready = true;
+    }
+}
+
+bool PathGuide::sample(const Vector3f& p, float u1, float u2, Vector3f& wi, float& pdf) const
+{
+    const Cell* cell = find(cellKey(p), false);
+    if (!cell || !cell->ready)
+        return false;
+
+    //u1先选bin，再重新映射到[0,1)作为bin内cosθ的偏移
+    int b = int(std::lower_bound(cell->cdf, cell->cdf + Bins, u1) - cell->cdf);
+    b = std::min(b, Bins - 1);
+    float lo = b > 0 ? cell->cdf[b - 1] : 0, binPmf = cell->cdf[b] - lo;
+    float uz = binPmf > 0 ? std::min((u1 - lo) / binPmf, 0.99999994f) : 0.5f;
+    int iz = b / PhiBins, ip = b % PhiBins;
+    float z = -1 + 2 * (iz + uz) / ThetaBins;
+    float phi = 2 * M_PI * (ip + u2) / PhiBins;
+    float r = std::sqrt(std::max(0.0f, 1 - z * z));
+    wi = Vector3f(r * std::cos(phi), r * std::sin(phi), z);
+    pdf = binPmf * Bins / (4 * M_PI);
+    return true;
+}
+
+float PathGuide::pdf(const Vector3f& p, const Vector3f& wi) const
+{
+    const Cell* cell = find(cellKey(p), false);
+    if (!cell || !cell->ready)
+        return 0;
+    int b = binIndex(wi);
+    float lo = b > 0 ? cell->cdf[b - 1] : 0;
+    return (cell->cdf[b] - lo) * Bins / (4 * M_PI);
+}
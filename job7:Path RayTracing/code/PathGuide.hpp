@@ -0,0 +1,56 @@
+#ifndef RAYTRACING_PATHGUIDE_H
+#define RAYTRACING_PATHGUIDE_H
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include "Vector.hpp"
+
+/*
+**路径引导：空间哈希网格，每个格子保存一个入射辐射度的方向直方图
+**直方图在(cosθ, φ)上均匀划分，每个bin对应的立体角相同(4π / Bins)
+**训练阶段各渲染线程用原子操作把Li / pdf按定点数累加到直方图，结果与线程的调度无关；update()在两遍之间把直方图转换成采样用的CDF
+*/
+class PathGuide
+{
+public:
+    static const int ThetaBins = 8;
+    static const int PhiBins = 16;
+    static const int Bins = ThetaBins * PhiBins;
+
+    explicit PathGuide(float cellSize = 25.0f, size_t capacity = size_t(1) << 14);
+
+    //记录一次入射辐射度估计：点p沿方向wi的入射辐射度为Li，该方向是以pdf采样得到的
+    void record(const Vector3f& p, const Vector3f& wi, float Li, float pdf);
+    //用目前为止记录的数据更新采样分布，在两遍渲染之间调用(不能与record/sample并发)
+    void update();
+
+    //点p所在格子已有可用的分布时返回true，wi为采样方向，pdf为立体角测度下的概率密度
+    bool sample(const Vector3f& p, float u1, float u2, Vector3f& wi, float& pdf) const;
+    float pdf(const Vector3f& p, const Vector3f& wi) const;
+
+    float cellSize;
+    bool training = true;//为false时不再记录
+    float guidedFraction = 0.5f;//可用时按引导分布采样的概率，其余按材质采样
+    uint32_t minSamples = 64;//格子至少有这么多记录才用于引导
+
+private:
+    struct Cell {
+        std::atomic<uint64_t> key{0};//0表示空
+        std::atomic<uint32_t> count{0};
+        std::atomic<uint64_t> histogram[Bins];//定点数，单位1 / FixedScale
+        float cdf[Bins];//update()生成，cdf[Bins - 1] == 1
+        bool ready = false;
+    };
+
+    uint64_t cellKey(const Vector3f& p) const;
+    Cell* find(uint64_t key, bool insert) const;
+    static int binIndex(const Vector3f& wi);
+
+    std::unique_ptr<Cell[]> cells;
+    size_t capacity;
+    static const int maxProbes = 16;
+    static constexpr float FixedScale = 1 << 20;
+    static constexpr float MaxRecord = 1e6f;//单次记录的上限，定点数的累加不会溢出
+};
+
+#endif //RAYTRACING_PATHGUIDE_H
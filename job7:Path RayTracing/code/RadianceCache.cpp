@@ -0,0 +1,84 @@
+#include <cmath>
+#include "RadianceCache.hpp"
+
+RadianceCache::RadianceCache(float cellSize, size_t capacity, uint32_t minSamples)
+    : cellSize(cellSize), minSamples(minSamples), cells(new Cell[capacity]), capacity(capacity)
+{
+    for (size_t i = 0; i < capacity; ++i)
+        for (auto& s : cells[i].sum) s.store(0.0f, std::memory_order_relaxed);
+}
+
+/*
+**每个坐标量化成20位有符号整数，法向量取绝对值最大的分量及其符号(6个方向)
+**最高位置1，保证有效的key不为0
+*/
+uint64_t RadianceCache::cellKey(const Vector3f& p, const Vector3f& N) const
+{
+    auto quantize = [this](float x) {
+        return uint64_t(int64_t(std::floor(x / cellSize)) + (1 << 19)) & 0xFFFFF;
+    };
+    float ax = std::fabs(N.x), ay = std::fabs(N.y), az = std::fabs(N.z);
+    uint64_t axis = ax > ay ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+    float c = axis == 0 ? N.x : axis == 1 ? N.y : N.z;
+    uint64_t dir = axis * 2 + (c < 0);
+    return (uint64_t(1) << 63) | (dir << 60) | (quantize(p.x) << 40) | (quantize(p.y) << 20) | quantize(p.z);
+}
+
+RadianceCache::Cell* RadianceCache::find(uint64_t key, bool insert) const
+{
+    //splitmix64
+    uint64_t h = key;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    h ^= h >> 31;
+
+    for (int probe = 0; probe < maxProbes; ++probe) {
+        Cell& cell = cells[(h + probe) % capacity];
+        uint64_t k = cell.key.load(std::memory_order_acquire);
+        if (k == key)
+            return &cell;
+        if (k == 0) {
+            if (!insert)
+                return nullptr;
+            uint64_t expected = 0;
+            if (cell.key.compare_exchange_strong(expected, key, std::memory_order_acq_rel) || expected == key)
+                return &cell;
+        }
+    }
+    return nullptr;
+}
+
+bool RadianceCache::lookup(const Vector3f& p, const Vector3f& N, Vector3f& L) const
+{
+    Cell* cell = find(cellKey(p, N), false);
+    if (!cell)
+        return false;
+    uint32_t count = cell->count.load(std::memory_order_acquire);
+    if (count < minSamples)
+        return false;
+    L = Vector3f(cell->sum[0].load(std::memory_order_relaxed),
+                 cell->sum[1].load(std::memory_order_relaxed),
+                 cell->sum[2].load(std::memory_order_relaxed)) / float(count);
+    return true;
+}
+
+void RadianceCache::add(const Vector3f& p, const Vector3f& N, const Vector3f& L)
+{
+    Cell* cell = find(cellKey(p, N), true);
+    if (!cell)
+        return;
+    const float v[3] = {L.x, L.y, L.z};
+    for (int c = 0; c < 3; ++c) {
+        float old = cell->sum[c].load(std::memory_order_relaxed);
+        while (!cell->sum[c].compare_exchange_weak(old, old + v[c], std::memory_order_relaxed)) {}
+    }
+    cell->count.fetch_add(1, std::memory_order_release);
+}
+
+size_t RadianceCache::size() const
+{
+    size_t n = 0;
+    for (size_t i = 0; i < capacity; ++i)
+        n += cells[i].key.load(std::memory_order_relaxed) != 0;
+    return n;
+}
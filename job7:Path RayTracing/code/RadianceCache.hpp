@@ -0,0 +1,43 @@
+#ifndef RAYTRACING_RADIANCECACHE_H
+#define RAYTRACING_RADIANCECACHE_H
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include "Vector.hpp"
+
+/*
+**世界空间的辐射度缓存：按(量化后的位置, 法向量所在的主轴方向)哈希到固定大小的表中
+**每个格子累加落在其中的漫反射点的出射辐射度，样本数达到minSamples后才可被查询
+**表项全部用原子操作更新，多个渲染线程可以同时写入和查询
+*/
+class RadianceCache
+{
+public:
+    explicit RadianceCache(float cellSize = 10.0f, size_t capacity = size_t(1) << 18, uint32_t minSamples = 16);
+
+    //查询点p(法向量N)处的缓存辐射度，格子不存在或样本不足时返回false
+    bool lookup(const Vector3f& p, const Vector3f& N, Vector3f& L) const;
+    //把点p处的一次出射辐射度估计L加入缓存
+    void add(const Vector3f& p, const Vector3f& N, const Vector3f& L);
+    //已占用的格子数
+    size_t size() const;
+
+    float cellSize;
+    uint32_t minSamples;
+
+private:
+    struct Cell {
+        std::atomic<uint64_t> key{0};//0表示空
+        std::atomic<float> sum[3];
+        std::atomic<uint32_t> count{0};
+    };
+
+    uint64_t cellKey(const Vector3f& p, const Vector3f& N) const;
+    Cell* find(uint64_t key, bool insert) const;
+
+    std::unique_ptr<Cell[]> cells;
+    size_t capacity;
+    static const int maxProbes = 16;//线性探测的最大长度，超过后放弃插入
+};
+
+#endif //RAYTRACING_RADIANCECACHE_H
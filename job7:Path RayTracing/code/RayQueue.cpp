@@ -0,0 +1,34 @@
+#include <algorithm>
+#include "RayQueue.hpp"
+
+//把4位整数的各位之间插入两个0
+static uint32_t expandBits(uint32_t v)
+{
+    v = (v | (v << 4)) & 0x0C3u;
+    v = (v | (v << 2)) & 0x249u;
+    return v;
+}
+
+uint32_t RayQueue::sortKey(const Ray& ray) const
+{
+    Vector3f o = bounds.Offset(ray.origin);
+    auto quantize = [](float x) { return uint32_t(std::min(std::max(x * 16.0f, 0.0f), 15.0f)); };
+    uint32_t morton = (expandBits(quantize(o.x)) << 2) | (expandBits(quantize(o.y)) << 1) | expandBits(quantize(o.z));
+    uint32_t octant = (ray.direction.x < 0) << 2 | (ray.direction.y < 0) << 1 | (ray.direction.z < 0);
+    return octant << 12 | morton;
+}
+
+const std::vector<uint32_t>& RayQueue::sort(const Ray* rays, size_t n)
+{
+    //计数排序：排序键只有2^KeyBits种，两遍线性扫描即可
+    keys.resize(n);
+    offsets.assign((1 << KeyBits) + 1, 0);
+    for (size_t i = 0; i < n; ++i)
+        ++offsets[(keys[i] = sortKey(rays[i])) + 1];
+    for (size_t k = 1; k < offsets.size(); ++k)
+        offsets[k] += offsets[k - 1];
+    order.resize(n);
+    for (size_t i = 0; i < n; ++i)
+        order[offsets[keys[i]]++] = uint32_t(i);
+    return order;
+}
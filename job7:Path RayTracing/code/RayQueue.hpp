@@ -0,0 +1,33 @@
+#ifndef RAYTRACING_RAYQUEUE_H
+#define RAYTRACING_RAYQUEUE_H
+#include <cstdint>
+#include <vector>
+#include "global.hpp"
+#include "Bounds3.hpp"
+#include "Ray.hpp"
+
+/*
+**光线重排：一批光线求交前按(方向卦限, 起点的Morton码)做计数排序
+**方向相近、起点相近的光线连续遍历BVH，访问的节点和三角形大多已在缓存中
+**由Scene的批量查询在每个线程的每一块光线上使用，结果仍按原顺序写回(见Scene::intersect(span, span))
+**递归的castRay没有改为延迟队列：它在每次弹射时都需要立即得到交点；需要重排的渲染使用波前模式(Renderer::wavefront)
+*/
+class RayQueue
+{
+public:
+    explicit RayQueue(const Bounds3& sceneBounds) : bounds(sceneBounds) {}
+
+    //对光线数组rays[0, n)排序，返回排序后的序号；结果在下一次调用前有效
+    const std::vector<uint32_t>& sort(const Ray* rays, size_t n);
+    //计算排序键：高3位为方向各分量的符号，低12位为起点在场景包围盒中的Morton码(每轴4位)
+    uint32_t sortKey(const Ray& ray) const;
+    static const int KeyBits = 15;
+
+private:
+    Bounds3 bounds;
+    std::vector<uint32_t> keys;
+    std::vector<uint32_t> offsets;//每个排序键的光线在order中的起始位置
+    std::vector<uint32_t> order;//排序后的入队序号
+};
+
+#endif //RAYTRACING_RAYQUEUE_H
@@ -0,0 +1,221 @@
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include "RenderServer.hpp"
+#include "Distributed.hpp"
+
+void RenderServer::addScene(const std::string& id, std::function<SceneBundle()> loader)
+{
+    auto& entry = scenes[id];
+    entry = std::make_unique<CachedScene>();
+    entry->loader = std::move(loader);
+}
+
+const SceneBundle& RenderServer::acquireScene(const std::string& id, double& loadSeconds)
+{
+    auto it = scenes.find(id);
+    if (it == scenes.end()) throw std::runtime_error("unknown scene " + id);
+    CachedScene& entry = *it->second;
+    //同一场景的并发请求只加载一次，其余请求等待加载完成；加载抛出异常时下一个请求重新加载
+    auto start = std::chrono::steady_clock::now();
+    std::call_once(entry.loaded, [&] {
+        entry.bundle = entry.loader();
+        if (!entry.bundle.scene) throw std::runtime_error("scene " + id + " failed to load");
+    });
+    loadSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return entry.bundle;
+}
+
+void RenderServer::admit(const std::string& client)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    auto entry = std::make_pair(client, nextTicket++);
+    waiting.push_back(entry);
+    //轮到自己：有空闲名额，且在等待者中(已放行数, 排队号)最小
+    auto first = [&] {
+        return *std::min_element(waiting.begin(), waiting.end(), [&](const auto& a, const auto& b) {
+            return std::make_pair(served[a.first], a.second) < std::make_pair(served[b.first], b.second);
+        });
+    };
+    admitted.wait(lock, [&] { return running < maxConcurrentJobs && first() == entry; });
+    waiting.erase(std::find(waiting.begin(), waiting.end(), entry));
+    ++running;
+    ++served[client];
+    admitted.notify_all();
+}
+
+void RenderServer::release()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    --running;
+    admitted.notify_all();
+}
+
+static Vector3f readVector(std::istringstream& in)
+{
+    float x, y, z;
+    if (!(in >> x >> y >> z)) throw std::runtime_error("expected 3 numbers");
+    return Vector3f(x, y, z);
+}
+
+std::string RenderServer::handle(const std::string& request, int connection)
+{
+    try {
+        std::string sceneId, output;
+        std::string client = "#" + std::to_string(connection);//未指定client时每个连接单独计数
+        Renderer settings = defaults;
+        int width = 0, height = 0;
+        std::optional<double> fov;
+        std::optional<Vector3f> eye, target, up;
+        std::string text = request;
+        std::replace(text.begin(), text.end(), ';', '\n');
+        std::istringstream lines(text);
+        std::string line;
+        while (std::getline(lines, line)) {
+            std::istringstream in(line);
+            std::string key;
+            if (!(in >> key)) continue;
+            bool ok = true;
+            if (key == "scene") ok = bool(in >> sceneId);
+            else if (key == "size") ok = bool(in >> width >> height) && width > 0 && height > 0;
+            else if (key == "fov") {
+                double value;
+                ok = bool(in >> value);
+                fov = value;
+            }
+            else if (key == "eye") eye = readVector(in);
+            else if (key == "target") target = readVector(in);
+            else if (key == "up") up = readVector(in);
+            else if (key == "spp") ok = bool(in >> settings.spp) && settings.spp > 0;
+            else if (key == "seed") ok = bool(in >> settings.seed);
+            else if (key == "output") ok = bool(in >> output);
+            else if (key == "client") ok = bool(in >> client);
+            else if (key == "shutdown") {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+                return "ok";
+            }
+            else throw std::runtime_error("unknown key " + key);
+            if (!ok) throw std::runtime_error("bad value for " + key);
+        }
+        if (sceneId.empty()) throw std::runtime_error("missing scene");
+
+        double loadSeconds = 0;
+        const SceneBundle& bundle = acquireScene(sceneId, loadSeconds);
+        const Scene& scene = *bundle.scene;
+        Camera camera = bundle.camera;
+        if (width) camera.width = width, camera.height = height;
+        if (fov) camera.fov = *fov;
+        if (eye) camera.eye = *eye;
+        if (target) camera.target = *target;
+        if (up) camera.up = *up;
+        settings.camera = camera;
+        settings.checkpointPath.clear();
+        settings.coordinator = nullptr;
+
+        admit(client);
+        auto start = std::chrono::steady_clock::now();
+        try {
+            auto sink = output.empty() ? nullptr : std::make_shared<PPMSink>(output);
+            settings.RenderAsync(scene, sink)->wait();
+        } catch (...) {
+            release();
+            throw;
+        }
+        release();
+        double renderSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        printf(" - Client %s: %s %dx%d, %d spp, load %.3fs, render %.3fs\n", client.c_str(), sceneId.c_str(),
+               camera.width, camera.height, settings.spp, loadSeconds, renderSeconds);
+        fflush(stdout);
+        char reply[64];
+        snprintf(reply, sizeof(reply), "ok load %.3f render %.3f", loadSeconds, renderSeconds);
+        return reply;
+    } catch (const std::exception& e) {
+        return std::string("error ") + e.what();
+    }
+}
+
+void RenderServer::serve(const std::string& address)
+{
+    Listener listener(address);
+    printf(" - Render server listening on %s\n", address.c_str());
+    fflush(stdout);
+    struct Connection
+    {
+        std::unique_ptr<Channel> channel;
+        std::thread thread;
+        bool busy = false;//是否正在处理请求，由mutex保护
+    };
+    std::map<int, Connection> connections;//仍在服务的连接，由mutex保护
+    std::vector<int> finished;//已断开、等待join的连接，由mutex保护
+    //join并移除已断开的连接，连接的线程和Channel不会一直累积到服务停止
+    auto reap = [&] {
+        std::vector<std::thread> done;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (int id : finished) {
+                done.push_back(std::move(connections[id].thread));
+                connections.erase(id);
+            }
+            finished.clear();
+        }
+        for (auto& t : done) t.join();
+    };
+    int nextConnection = 0;
+    while (true) {
+        std::unique_ptr<Channel> channel;
+        try {
+            channel = listener.accept();
+        } catch (const std::exception&) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping) break;
+            throw;
+        }
+        reap();
+        int id = nextConnection++;
+        Channel* c = channel.get();
+        std::lock_guard<std::mutex> lock(mutex);
+        Connection& connection = connections[id];
+        connection.channel = std::move(channel);
+        connection.thread = std::thread([this, c, id, &listener, &connections, &finished] {
+            std::string request;
+            while (c->receive(request)) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    connections[id].busy = true;
+                }
+                c->send(handle(request, id));
+                std::lock_guard<std::mutex> lock(mutex);
+                connections[id].busy = false;
+                if (stopping) {
+                    listener.stop();
+                    break;
+                }
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            finished.push_back(id);
+        });
+    }
+    //空闲的连接直接断开，正在处理的请求完成并回复后再退出
+    std::vector<std::thread> remaining;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& [id, connection] : connections) {
+            if (!connection.busy) connection.channel->close();
+            remaining.push_back(std::move(connection.thread));
+        }
+    }
+    for (auto& t : remaining) t.join();
+}
+
+std::string sendRequest(const std::string& address, const std::string& request)
+{
+    auto channel = connectTo(address);
+    std::string reply;
+    if (!channel->send(request) || !channel->receive(reply))
+        throw std::runtime_error("no reply from " + address);
+    return reply;
+}
@@ -0,0 +1,71 @@
+#ifndef RAYTRACING_RENDERSERVER_H
+#define RAYTRACING_RENDERSERVER_H
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Renderer.hpp"
+
+/*
+**常驻渲染服务：场景第一次被请求时加载并构建BVH，之后一直保存在内存中，后续任务直接开始渲染
+**请求为文本，每行(或用';'分隔)一个"键 值..."：
+**  scene <id>          已通过addScene注册的场景(必须)
+**  size <w> <h>        输出分辨率
+**  fov <度>  eye <x y z>  target <x y z>  up <x y z>   相机参数
+**  未指定的相机参数和分辨率使用场景的默认视点(SceneBundle::camera)
+**  spp <n>  seed <n>   覆盖defaults中的设置
+**  output <path>       结果写入的PPM文件(服务进程的工作目录下)，省略时只渲染不输出
+**  client <name>       提交者名称，用于公平调度；省略时按连接区分(--submit每个请求一个连接)
+**  shutdown            等正在渲染的任务结束后停止服务
+**回复为"ok load <秒> render <秒>"或"error <原因>"，load为本次请求等待场景加载的时间，场景已缓存时为0
+**
+**同时渲染的任务数不超过maxConcurrentJobs，任务共享同一个线程池；等待中的任务按各客户端(client)已放行的任务数
+**从少到多放行，数目相同时先到先得，一个客户端连续提交的大量任务不会让其他客户端一直等待
+*/
+class RenderServer
+{
+public:
+    explicit RenderServer(Renderer defaults = Renderer()) : defaults(std::move(defaults)) {}
+
+    //注册场景，loader在第一次请求时调用；在serve之前调用
+    void addScene(const std::string& id, std::function<SceneBundle()> loader);
+    //在address上监听(格式见Distributed.hpp)，每个连接一个线程，一个连接上可以依次发送多个请求，连接断开后回收其线程；
+    //收到shutdown后返回
+    void serve(const std::string& address);
+    //处理一个请求并返回回复，请求未指定client时以连接编号connection作为客户端
+    std::string handle(const std::string& request, int connection = 0);
+
+    Renderer defaults;//请求中未指定的渲染设置
+    int maxConcurrentJobs = 2;//同时渲染的任务数上限
+
+private:
+    struct CachedScene
+    {
+        std::function<SceneBundle()> loader;
+        std::once_flag loaded;
+        SceneBundle bundle;
+    };
+
+    //返回已加载的场景，必要时在调用线程中加载；loadSeconds为本次调用等待加载的时间
+    const SceneBundle& acquireScene(const std::string& id, double& loadSeconds);
+    void admit(const std::string& client);
+    void release();
+
+    std::map<std::string, std::unique_ptr<CachedScene>> scenes;
+
+    std::mutex mutex;//保护以下调度状态
+    std::condition_variable admitted;
+    int running = 0;
+    uint64_t nextTicket = 0;
+    std::vector<std::pair<std::string, uint64_t>> waiting;//等待中的(客户端, 排队号)
+    std::map<std::string, uint64_t> served;//每个客户端已放行的任务数
+    bool stopping = false;
+};
+
+//连接address上的渲染服务，发送一个请求并返回回复；连接失败或没有回复时抛出std::runtime_error
+std::string sendRequest(const std::string& address, const std::string& request);
+
+#endif //RAYTRACING_RENDERSERVER_H
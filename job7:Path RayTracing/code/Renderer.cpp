@@ -1,50 +1,787 @@
 #include <fstream>
+#include <stdexcept>
 #include "Scene.hpp"
 #include "Renderer.hpp"
-
-inline float deg2rad(const float& deg) { return deg * M_PI / 180.0; }
+#include "Distributed.hpp"
 
 const float EPSILON = 0.00001;
 
+bool RenderJob::wait()
+{
+    result.get();
+    return completed;
+}
+
+std::vector<Vector3f> RenderJob::snapshot() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return framebuffer;
+}
+
+std::vector<uint32_t> RenderJob::sampleCounts() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return sampleCount;
+}
+
+void RenderJob::report(float p)
+{
+    progressValue.store(p);
+    if (onProgress) onProgress(p);
+}
+
+bool RenderJob::finishTile(int x0, int y0, int x1, int y1, const std::vector<Vector3f>& tile, uint32_t samples, int tileCount)
+{
+    if (tileSink) tileSink->writeTile(TileRect{x0, y0, x1, y1}, tile);
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int y = y0; framebuffer.size() && y < y1; ++y) {
+        std::copy(tile.begin() + (y - y0) * (x1 - x0), tile.begin() + (y - y0 + 1) * (x1 - x0),
+                  framebuffer.begin() + y * width + x0);
+        std::fill(sampleCount.begin() + y * width + x0, sampleCount.begin() + y * width + x1, samples);
+    }
+    report(++tilesDone / (float)tileCount);
+    return !cancelled();
+}
+
+bool RenderJob::finishPass(const std::vector<Vector3f>& accum, int done, int total)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    float scale = total / (float)done;
+    for (size_t k = 0; k < framebuffer.size(); ++k)
+        framebuffer[k] = accum[k] * scale;
+    report(done / (float)total);
+    return !cancelled();
+}
+
+void TileDependencies::invalidate(const Object* object)
+{
+    uint32_t id = object->sceneId;
+    if (id == UINT32_MAX) return;
+    if (dirty.size() <= id / 64) dirty.resize(id / 64 + 1);
+    dirty[id / 64] |= uint64_t(1) << (id % 64);
+}
+
+void TileDependencies::invalidate(const Scene& scene, Material* material)
+{
+    if (material->hasEmission()) {
+        invalidateAll();
+        return;
+    }
+    for (auto object : scene.objects)
+        if (object->getMaterial() == material) invalidate(object);
+}
+
 //This where we iterate over all pixels in the image,
 //generate primary rays and cast these rays into the scene. The content of the
 //framebuffer is saved to a file.
 void Renderer::Render(const Scene& scene)
 {
-    std::vector<Vector3f> framebuffer(scene.width * scene.height);//存储像素点颜色的数组
+    RenderAsync(scene, std::make_shared<PPMSink>("binary.ppm"), UpdateProgress)->wait();
+}
 
-    float scale = tan(deg2rad(scene.fov * 0.5));//tan(fov/2)
-    float imageAspectRatio = scene.width / (float)scene.height;//屏幕宽高比
-    Vector3f eye_pos(278, 273, -800);
-    int m = 0;
+std::shared_ptr<RenderJob> Renderer::RenderAsync(const Scene& scene, std::shared_ptr<OutputSink> sink,
+                                                 std::function<void(float)> onProgress) const
+{
+    auto job = std::make_shared<RenderJob>(camera ? *camera : Camera(scene.width, scene.height, scene.fov), !tileSink);
+    job->sink = tileSink ? nullptr : std::move(sink);
+    job->tileSink = tileSink;
+    job->onProgress = std::move(onProgress);
+    job->result = std::async(std::launch::async, [settings = *this, &scene, job]() mutable {
+        if (settings.tileSink) {
+            if (settings.timeBudget > 0 || settings.restir || settings.wavefront || scene.pathGuide)
+                throw std::runtime_error("tiled output only supports the default render mode");
+            if (!settings.checkpointPath.empty() || settings.incremental || settings.denoiser)
+                throw std::runtime_error("tiled output cannot be combined with checkpoints, incremental rendering or denoising");
+            settings.tileSink->begin(job->width, job->height);
+            settings.RenderTiles(scene, *job);
+            settings.tileSink->end();
+        } else if (settings.timeBudget > 0)
+            settings.RenderBudget(scene, *job);
+        else if (settings.restir)
+            settings.RenderReSTIR(scene, *job);
+        else if (settings.wavefront)
+            settings.RenderWavefront(scene, *job);
+        else if (scene.pathGuide)
+            settings.RenderGuided(scene, *job);
+        else
+            settings.RenderTiles(scene, *job);
+        if (job->cancelled()) return;
+        if (settings.denoiser) {
+            auto denoised = settings.denoiser->denoise(job->snapshot(), renderAOVs(scene, job->camera));
+            std::lock_guard<std::mutex> lock(job->mutex);
+            job->framebuffer = std::move(denoised);
+        }
+        job->completed = true;
+        if (job->sink) job->sink->write(job->width, job->height, job->snapshot());
+    }).share();
+    return job;
+}
+
+void Renderer::saveCheckpoint(RenderJob& job, bool background) const
+{
+    std::unique_lock<std::mutex> guard(job.checkpointMutex, std::defer_lock);
+    if (background) {
+        if (!guard.try_lock()) return;//另一个线程正在发起检查点
+    } else {
+        guard.lock();
+    }
+    if (job.checkpointWriter.valid()) {
+        if (background && job.checkpointWriter.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            return;
+        job.checkpointWriter.get();
+    }
 
-    // int spp = 16;
-    int spp = 64;//每个像素64个采样点
-    std::cout << "SPP: " << spp << "\n";
-    for (uint32_t j = 0; j < scene.height; ++j) {
-        for (uint32_t i = 0; i < scene.width; ++i) {//遍历所有像素点
-            float x = (2 * (i + 0.5) / (float)scene.width - 1) * imageAspectRatio * scale;//x怎么算的？
-            float y = (1 - 2 * (j + 0.5) / (float)scene.height) * scale;
+    auto cp = std::make_shared<Checkpoint>();
+    cp->width = job.width;
+    cp->height = job.height;
+    cp->spp = spp;
+    cp->seed = seed;
+    {
+        std::lock_guard<std::mutex> lock(job.mutex);
+        cp->accum = job.framebuffer;
+        cp->samples = job.sampleCount;
+    }
+    job.lastCheckpoint = std::chrono::steady_clock::now().time_since_epoch().count();
+    if (background)
+        job.checkpointWriter = std::async(std::launch::async, [cp, path = checkpointPath] { cp->save(path); });
+    else
+        cp->save(checkpointPath);
+}
 
-            Vector3f dir = normalize(Vector3f(-x, y, 1));//光线方向的世界坐标？
-            for (int k = 0; k < spp; k++){//在像素点内循环spp次
-                framebuffer[m] += scene.castRay(Ray(eye_pos, dir), 0) / spp;//插值全部采样数据  
+/*
+**像素k的第s个样本前用(seed, k * spp + s)重新设定随机数发生器，结果与由哪个线程或进程渲染无关
+**从检查点继续时从已完成的样本数开始，累加顺序与不中断时相同
+*/
+std::vector<Vector3f> Renderer::renderTile(const Scene& scene, const Camera& camera, const TileRect& rect,
+                                           const Checkpoint* start) const
+{
+    std::vector<Vector3f> tile((rect.x1 - rect.x0) * (rect.y1 - rect.y0));
+    int m = 0;
+    for (int j = rect.y0; j < rect.y1; ++j)
+        for (int i = rect.x0; i < rect.x1; ++i) {//遍历图块内的像素点
+            size_t idx = size_t(j) * camera.width + i;
+            Ray ray = camera.generateRay(i, j);
+            int k = 0;
+            if (start) {
+                tile[m] = start->accum[idx];
+                k = start->samples[idx];
+            }
+            for (; k < spp; k++) {//在像素点内循环spp次
+                seed_random(seed, uint64_t(idx) * spp + k);
+                tile[m] += scene.castRay(ray, 0) / spp;//插值全部采样数据
             }
             m++;
         }
-        UpdateProgress(j / (float)scene.height);//？？？
+    return tile;
+}
+
+static bool sameCamera(const Camera& a, const Camera& b)
+{
+    auto same = [](const Vector3f& u, const Vector3f& v) { return u.x == v.x && u.y == v.y && u.z == v.z; };
+    return a.width == b.width && a.height == b.height && a.fov == b.fov && same(a.eye, b.eye) &&
+           same(a.target, b.target) && same(a.up, b.up);
+}
+
+static bool sameRect(const std::optional<TileRect>& a, const std::optional<TileRect>& b)
+{
+    if (!a || !b) return !a && !b;
+    return a->x0 == b->x0 && a->y0 == b->y0 && a->x1 == b->x1 && a->y1 == b->y1;
+}
+
+/*
+**默认模式：图像切成tileSize x tileSize的图块，由共享线程池(或coordinator连接的worker)并行渲染，每个图块完成后写回RenderJob
+**设置crop时图块裁剪到crop内，完全在crop外的图块不渲染
+*/
+void Renderer::RenderTiles(const Scene& scene, RenderJob& job)
+{
+    int tilesX = (job.width + tileSize - 1) / tileSize, tilesY = (job.height + tileSize - 1) / tileSize;
+    int tileCount = tilesX * tilesY;
+    bool checkpointing = !checkpointPath.empty();
+
+    Checkpoint start;
+    bool resumed = checkpointing && resume && start.load(checkpointPath);
+    if (resumed) {
+        if (start.width != job.width || start.height != job.height || start.spp != spp || start.seed != seed)
+            throw std::runtime_error("checkpoint " + checkpointPath + " was written with different settings");
+        job.framebuffer = start.accum;
+        job.sampleCount = start.samples;
+        std::cout << "Resuming from " << checkpointPath << "\n";
+    }
+    job.lastCheckpoint = std::chrono::steady_clock::now().time_since_epoch().count();
+
+    //增量渲染：设置与上一次相同时，没有碰到被修改物体的图块直接复制上一次的结果
+    TileDependencies* deps = coordinator ? nullptr : incremental;
+    bool reuse = deps && deps->valid && sameCamera(deps->camera, job.camera) && deps->spp == spp &&
+                 deps->seed == seed && deps->tileSize == tileSize && sameRect(deps->crop, crop);
+    if (deps && !reuse) deps->touched.assign(tileCount, {});
+    if (deps) deps->valid = false;//被取消时下一次完整渲染
+    auto affected = [&](int t) {
+        const auto& bits = deps->touched[t];
+        for (size_t w = 0; w < std::min(bits.size(), deps->dirty.size()); ++w)
+            if (bits[w] & deps->dirty[w]) return true;
+        return false;
+    };
+
+    //检查点中已完成的图块不再渲染
+    std::vector<TileRect> tiles;
+    std::vector<int> tileIds;
+    for (int t = 0; t < tileCount; ++t) {
+        int x0 = (t % tilesX) * tileSize, y0 = (t / tilesX) * tileSize;
+        TileRect rect{x0, y0, std::min(x0 + tileSize, job.width), std::min(y0 + tileSize, job.height)};
+        if (crop) {
+            rect = {std::max(rect.x0, crop->x0), std::max(rect.y0, crop->y0), std::min(rect.x1, crop->x1),
+                    std::min(rect.y1, crop->y1)};
+            if (rect.x0 >= rect.x1 || rect.y0 >= rect.y1) {
+                ++job.tilesDone;
+                continue;
+            }
+        }
+        if (reuse && !affected(t)) {
+            for (int j = rect.y0; j < rect.y1; ++j)
+                for (int i = rect.x0; i < rect.x1; ++i) {
+                    job.framebuffer[j * job.width + i] = deps->image[j * job.width + i];
+                    job.sampleCount[j * job.width + i] = spp;
+                }
+            ++job.tilesDone;
+            continue;
+        }
+        bool complete = resumed;
+        for (int j = rect.y0; complete && j < rect.y1; ++j)
+            for (int i = rect.x0; complete && i < rect.x1; ++i)
+                complete = start.samples[j * job.width + i] >= (uint32_t)spp;
+        if (complete) {
+            ++job.tilesDone;
+        } else {
+            tiles.push_back(rect);
+            tileIds.push_back(t);
+        }
+    }
+
+    auto afterTile = [&] {
+        if (checkpointing && std::chrono::steady_clock::now() - std::chrono::steady_clock::time_point(
+                                 std::chrono::steady_clock::duration(job.lastCheckpoint.load())) >
+                             std::chrono::duration<double>(checkpointInterval))
+            saveCheckpoint(job, true);
+    };
+
+    std::cout << "SPP: " << spp;
+    if (deps) std::cout << ", " << tiles.size() << " of " << tileCount << " tiles";
+    std::cout << "\n";
+    if (coordinator) {
+        coordinator->render(*this, job, tiles, tileCount, afterTile);
+    } else {
+        ThreadPool::shared().parallelFor(tiles.size(), 1, [&](size_t begin, size_t end) {
+            for (size_t t = begin; t < end; ++t) {
+                if (job.cancelled()) return;
+                const TileRect& rect = tiles[t];
+                if (deps) {
+                    deps->touched[tileIds[t]].clear();
+                    Scene::recordTouched(&deps->touched[tileIds[t]]);
+                }
+                std::vector<Vector3f> tile = renderTile(scene, job.camera, rect, resumed ? &start : nullptr);
+                Scene::recordTouched(nullptr);
+                if (!job.finishTile(rect.x0, rect.y0, rect.x1, rect.y1, tile, spp, tileCount)) return;
+                afterTile();
+            }
+        });
+    }
+    if (checkpointing)
+        saveCheckpoint(job, false);
+    if (deps && !job.cancelled()) {
+        deps->valid = true;
+        deps->camera = job.camera;
+        deps->spp = spp;
+        deps->seed = seed;
+        deps->tileSize = tileSize;
+        deps->crop = crop;
+        deps->image = job.snapshot();
+        deps->dirty.clear();
+    }
+}
+
+void Renderer::RenderBatch(const Scene& scene, const std::vector<Camera>& cameras,
+                           const std::vector<std::shared_ptr<OutputSink>>& sinks, std::function<void(float)> onProgress) const
+{
+    if (restir || wavefront || scene.pathGuide) {
+        Renderer settings = *this;
+        for (size_t v = 0; v < cameras.size(); ++v) {
+            settings.camera = cameras[v];
+            settings.RenderAsync(scene, v < sinks.size() ? sinks[v] : nullptr, [&](float p) {
+                if (onProgress) onProgress((v + p) / cameras.size());
+            })->wait();
+        }
+        return;
     }
-    UpdateProgress(1.f);
 
-    // save framebuffer to file
-    FILE* fp = fopen("binary.ppm", "wb");
-    (void)fprintf(fp, "P6\n%d %d\n255\n", scene.width, scene.height);
-    for (auto i = 0; i < scene.height * scene.width; ++i) {
-        static unsigned char color[3];
-        color[0] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].x), 0.6f));
-        color[1] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].y), 0.6f));
-        color[2] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].z), 0.6f));
-        fwrite(color, 1, 3, fp);
+    struct View
+    {
+        std::once_flag created;
+        std::unique_ptr<RenderJob> job;//取到第一个图块时才分配，写出后释放；同时存在的帧缓冲只有正在渲染的几个视点
+        int tileCount = 0;
+        std::atomic<int> remaining{0};
+    };
+    std::vector<View> views(cameras.size());
+    std::vector<std::pair<size_t, TileRect>> tiles;//(视点, 图块)
+    for (size_t v = 0; v < cameras.size(); ++v) {
+        int width = cameras[v].width, height = cameras[v].height;
+        for (int y0 = 0; y0 < height; y0 += tileSize)
+            for (int x0 = 0; x0 < width; x0 += tileSize) {
+                tiles.push_back({v, TileRect{x0, y0, std::min(x0 + tileSize, width), std::min(y0 + tileSize, height)}});
+                ++views[v].tileCount;
+            }
+        views[v].remaining = views[v].tileCount;
+    }
+
+    std::cout << "SPP: " << spp << ", " << cameras.size() << " views\n";
+    std::mutex progressMutex;
+    size_t tilesDone = 0;
+    std::exception_ptr error;
+    ThreadPool::shared().parallelFor(tiles.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t t = begin; t < end; ++t) {
+            auto& [v, rect] = tiles[t];
+            View& view = views[v];
+            std::call_once(view.created, [&] { view.job = std::make_unique<RenderJob>(cameras[v]); });
+            std::vector<Vector3f> tile = renderTile(scene, cameras[v], rect);
+            view.job->finishTile(rect.x0, rect.y0, rect.x1, rect.y1, tile, spp, view.tileCount);
+            if (--view.remaining == 0 && v < sinks.size() && sinks[v]) {
+                try {
+                    sinks[v]->write(view.job->width, view.job->height, view.job->snapshot());
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(progressMutex);
+                    if (!error) error = std::current_exception();
+                }
+                view.job.reset();//写出后释放帧缓冲
+            }
+            std::lock_guard<std::mutex> lock(progressMutex);
+            ++tilesDone;
+            if (onProgress) onProgress(tilesDone / (float)tiles.size());
+        }
+    });
+    if (error) std::rethrow_exception(error);
+}
+
+/*
+**时间复用：上一帧保存每个像素的结果、等效样本数和主光线命中(位置、法向量、物体)
+**本帧像素的命中点投影到上一帧相机上取最近的像素，命中同一物体、位置相差不到距离的1%、法向量夹角小于约25度时视为可复用
+**样本的随机数流为((帧 * 像素数 + 像素) * spp + 样本)，第0帧与Render的结果逐位相同
+*/
+void Renderer::RenderSequence(Scene& scene, int frames, const std::function<Camera(int)>& advance,
+                              const std::function<std::shared_ptr<OutputSink>(int)>& sink,
+                              std::function<void(float)> onProgress) const
+{
+    struct Pixel
+    {
+        Vector3f color;
+        float samples = 0;
+        Vector3f position, normal;
+        Object* obj = nullptr;
+    };
+    std::vector<Pixel> previous, current;
+    Camera previousCamera;
+    std::vector<Bounds3> bounds;
+    for (auto obj : scene.objects) bounds.push_back(obj->getBounds());
+
+    for (int frame = 0; frame < frames; ++frame) {
+        auto start = std::chrono::steady_clock::now();
+        Camera camera = advance(frame);
+        //包围盒变化的物体为动态物体，命中它们的像素不复用
+        std::vector<Object*> moved;
+        for (size_t k = 0; k < scene.objects.size(); ++k) {
+            Bounds3 b = scene.objects[k]->getBounds();
+            if (b.pMin.x != bounds[k].pMin.x || b.pMin.y != bounds[k].pMin.y || b.pMin.z != bounds[k].pMin.z ||
+                b.pMax.x != bounds[k].pMax.x || b.pMax.y != bounds[k].pMax.y || b.pMax.z != bounds[k].pMax.z)
+                moved.push_back(scene.objects[k]);
+            bounds[k] = b;
+        }
+        if (!moved.empty()) scene.refitBVH();
+        bool history = frame > 0 && camera.width == previousCamera.width && camera.height == previousCamera.height;
+
+        int width = camera.width, height = camera.height, n = width * height;
+        current.assign(n, Pixel());
+        std::atomic<int> reused{0};
+        std::atomic<uint64_t> traced{0};
+        ThreadPool::shared().parallelFor(height, 1, [&](size_t begin, size_t end) {
+            for (int j = int(begin); j < int(end); ++j)
+                for (int i = 0; i < width; ++i) {
+                    size_t idx = size_t(j) * width + i;
+                    Ray ray = camera.generateRay(i, j);
+                    Intersection hit = scene.intersect(ray);
+                    Pixel& px = current[idx];
+                    px.position = hit.coords;
+                    px.normal = hit.normal;
+                    px.obj = hit.happened ? hit.obj : nullptr;
+
+                    const Pixel* prev = nullptr;
+                    float pi, pj;
+                    if (history && px.obj && std::find(moved.begin(), moved.end(), px.obj) == moved.end() &&
+                        previousCamera.project(hit.coords, pi, pj)) {
+                        int qi = int(std::lround(pi)), qj = int(std::lround(pj));
+                        if (qi >= 0 && qi < width && qj >= 0 && qj < height) {
+                            const Pixel& q = previous[size_t(qj) * width + qi];
+                            if (q.obj == px.obj && (q.position - hit.coords).norm() < 0.01f * hit.distance &&
+                                dotProduct(q.normal, hit.normal) > 0.9f)
+                                prev = &q;
+                        }
+                    }
+
+                    int count = prev ? std::min(temporalSpp, spp) : spp;
+                    Vector3f estimate;
+                    for (int k = 0; k < count; ++k) {
+                        seed_random(seed, (uint64_t(frame) * n + idx) * spp + k);
+                        estimate += scene.castRay(ray, 0) / count;
+                    }
+                    //新样本的亮度与历史相差太大(动态物体投到静止表面上的阴影等)时丢弃历史，补足完整的spp
+                    if (prev) {
+                        float fresh = (estimate.x + estimate.y + estimate.z) / 3;
+                        float past = (prev->color.x + prev->color.y + prev->color.z) / 3;
+                        if (std::abs(fresh - past) > temporalReject * (fresh + past)) {
+                            prev = nullptr;
+                            estimate = estimate * (float(count) / spp);
+                            for (int k = count; k < spp; ++k) {
+                                seed_random(seed, (uint64_t(frame) * n + idx) * spp + k);
+                                estimate += scene.castRay(ray, 0) / spp;
+                            }
+                            count = spp;
+                        }
+                    }
+                    float h = prev ? std::min(prev->samples, float(temporalHistory > 0 ? temporalHistory : spp)) : 0;
+                    px.color = prev ? (prev->color * h + estimate * count) / (h + count) : estimate;
+                    px.samples = h + count;
+                    if (prev) ++reused;
+                    traced += count;
+                }
+        });
+
+        std::vector<Vector3f> image(n);
+        for (int k = 0; k < n; ++k) image[k] = current[k].color;
+        if (auto out = sink(frame)) out->write(width, height, image);
+        printf(" - Frame %d: %.1f%% pixels reused, %.1f samples/pixel, %.2f s\n", frame, 100.0 * reused / n,
+               traced / double(n), std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        if (onProgress) onProgress((frame + 1) / (float)frames);
+        std::swap(previous, current);
+        previousCamera = camera;
+    }
+}
+
+/*
+**限时模式：第pass遍给每个像素追加一个样本，随机数流为(seed, pass * 2^32 + 像素)，与截止时间无关，同样的遍数得到同样的结果
+**每个图块完成后立即更新RenderJob中的平均值和样本数，截止时正在渲染的图块完成后返回，超出预算的时间不超过一个图块
+*/
+void Renderer::RenderBudget(const Scene& scene, RenderJob& job)
+{
+    using Clock = std::chrono::steady_clock;
+    auto start = Clock::now();
+    auto deadline = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(timeBudget));
+    std::vector<TileRect> tiles;
+    for (int y0 = 0; y0 < job.height; y0 += tileSize)
+        for (int x0 = 0; x0 < job.width; x0 += tileSize)
+            tiles.push_back({x0, y0, std::min(x0 + tileSize, job.width), std::min(y0 + tileSize, job.height)});
+
+    std::vector<Vector3f> accum(job.width * job.height);
+    std::atomic<uint64_t> rays{0};
+    std::atomic<bool> expired{false};
+    std::cout << "Time budget: " << timeBudget << " s\n";
+    for (uint32_t pass = 0; !expired && !job.cancelled(); ++pass) {
+        ThreadPool::shared().parallelFor(tiles.size(), 1, [&](size_t begin, size_t end) {
+            for (size_t t = begin; t < end; ++t) {
+                if (job.cancelled() || (pass > 0 && Clock::now() >= deadline)) {
+                    expired = true;
+                    return;
+                }
+                const TileRect& rect = tiles[t];
+                uint64_t before = Scene::threadRayCount();
+                for (int j = rect.y0; j < rect.y1; ++j)
+                    for (int i = rect.x0; i < rect.x1; ++i) {
+                        size_t idx = size_t(j) * job.width + i;
+                        seed_random(seed, uint64_t(pass) << 32 | idx);//(遍数, 像素)打包成序列号，由seed_random打散
+                        accum[idx] += scene.castRay(job.camera.generateRay(i, j), 0);
+                    }
+                rays += Scene::threadRayCount() - before;
+                std::lock_guard<std::mutex> lock(job.mutex);
+                for (int j = rect.y0; j < rect.y1; ++j)
+                    for (int i = rect.x0; i < rect.x1; ++i) {
+                        size_t idx = size_t(j) * job.width + i;
+                        job.framebuffer[idx] = accum[idx] / float(pass + 1);
+                        job.sampleCount[idx] = pass + 1;
+                    }
+            }
+        });
+        std::lock_guard<std::mutex> lock(job.mutex);
+        job.report(std::min(1.0, std::chrono::duration<double>(Clock::now() - start).count() / timeBudget));
+    }
+
+    std::vector<uint32_t> samples = job.sampleCounts();
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    double total = 0;
+    for (uint32_t s : samples) total += s;
+    printf("\n - %.2f s: %.2f spp (min %u, max %u), %.2f Mrays/s\n", seconds, total / samples.size(),
+           *std::min_element(samples.begin(), samples.end()), *std::max_element(samples.begin(), samples.end()),
+           rays / seconds / 1e6);
+}
+
+/*
+**路径引导按遍渲染，每遍每个像素一个样本，各行由共享线程池并行渲染；前guideTrainingPasses遍记录入射辐射度，
+**每遍结束后在调用线程中更新分布，下一遍开始前所有线程都已看到新的分布
+*/
+void Renderer::RenderGuided(const Scene& scene, RenderJob& job)
+{
+    std::vector<Vector3f> framebuffer(job.width * job.height);
+    std::cout << "SPP: " << spp << " (path guiding, " << guideTrainingPasses << " training passes)\n";
+    std::vector<Ray> rays;
+    for (int j = 0; j < job.height; ++j)
+        for (int i = 0; i < job.width; ++i)
+            rays.push_back(job.camera.generateRay(i, j));
+    for (int pass = 0; pass < spp; ++pass) {
+        scene.pathGuide->training = pass < guideTrainingPasses;
+        ThreadPool::shared().parallelFor(job.height, 1, [&](size_t begin, size_t end) {
+            for (size_t k = begin * job.width; k < end * job.width; ++k) {
+                seed_random(seed, uint64_t(k) * spp + pass);
+                framebuffer[k] += scene.castRay(rays[k], 0) / spp;
+            }
+        });
+        if (scene.pathGuide->training)
+            scene.pathGuide->update();
+        if (!job.finishPass(framebuffer, pass + 1, spp)) return;
+    }
+}
+
+/*
+**光源采样点s对交点inter的(不考虑遮挡的)直接光照贡献：emit * f_r * cos * cos' / r^2
+*/
+static Vector3f lightContribution(const Intersection& inter, const Vector3f& wo, const LightSample& s)
+{
+    Vector3f d = s.coords - inter.coords;
+    float dist2 = dotProduct(d, d);
+    Vector3f wi = normalize(d);
+    float cosP = dotProduct(wi, inter.normal), cosL = -dotProduct(wi, s.normal);
+    if (dist2 == 0 || cosP <= 0 || cosL <= 0)
+        return Vector3f(0);
+    return s.emit * inter.m->eval(wo, wi, inter.normal) * cosP * cosL / dist2;
+}
+
+//蓄水池重采样的目标函数p_hat：贡献的亮度
+static float targetPdf(const Intersection& inter, const Vector3f& wo, const LightSample& s)
+{
+    Vector3f f = lightContribution(inter, wo, s);
+    return (f.x + f.y + f.z) / 3;
+}
+
+static void finalizeReservoir(Reservoir& r, float pHat)
+{
+    r.W = (pHat > 0 && r.M > 0) ? r.wSum / (r.M * pHat) : 0;
+}
+
+/*
+**ReSTIR直接光照(Bitterli et al. 2020)，相机不动，每一遍的主光线都打到同一个交点上：
+**1.每个像素用光源BVH生成restirCandidates个候选，做重采样重要性采样(RIS)得到蓄水池
+**2.与同一像素上一遍的蓄水池合并(时间复用)，历史长度截断为restirHistory倍
+**3.与半径restirRadius内法向量、深度相近的邻近像素合并(空间复用)
+**4.对最终保留的光源点追踪一条阴影光线；间接光照仍由Scene::indirectLight按路径追踪计算
+**合并时按候选数M归一化(有偏版本)，用法向量和深度的相似性检查抑制偏差
+**每个阶段的各行由共享线程池并行处理；空间复用只读取上一阶段的temporal，写入spatial，两个阶段之间没有数据竞争
+**像素k在第pass遍第phase阶段的随机数流为((pass * 像素数 + k) * 3 + phase)，结果与线程的调度无关
+*/
+void Renderer::RenderReSTIR(const Scene& scene, RenderJob& job)
+{
+    int width = job.width, height = job.height, n = width * height;
+    std::vector<Vector3f> framebuffer(n);
+    std::vector<Ray> rays;
+    std::vector<Intersection> gbuffer(n);
+    rays.reserve(n);
+    for (int j = 0; j < height; ++j)
+        for (int i = 0; i < width; ++i)
+            rays.push_back(job.camera.generateRay(i, j));
+    ThreadPool::shared().parallelFor(height, 1, [&](size_t begin, size_t end) {
+        for (int k = int(begin) * width; k < int(end) * width; ++k) gbuffer[k] = scene.intersect(rays[k]);
+    });
+    auto shaded = [&](int k) { return gbuffer[k].happened && !gbuffer[k].m->hasEmission(); };
+
+    std::vector<Reservoir> prev(n), temporal(n), spatial(n);
+    std::cout << "ReSTIR: " << restirPasses << " passes, " << restirCandidates << " candidates, "
+              << restirNeighbors << " neighbors\n";
+
+    //对每一行的像素并行执行phase阶段，每个像素先切换到自己的随机数流
+    auto forEachPixel = [&](int pass, int phase, const std::function<void(int)>& body) {
+        ThreadPool::shared().parallelFor(height, 1, [&](size_t begin, size_t end) {
+            for (int k = int(begin) * width; k < int(end) * width; ++k) {
+                seed_random(seed, ((uint64_t(pass) * n + k) * 3 + phase));
+                body(k);
+            }
+        });
+    };
+
+    for (int pass = 0; pass < restirPasses; ++pass) {
+        //初始候选 + 时间复用
+        forEachPixel(pass, 0, [&](int k) {
+            temporal[k] = Reservoir();
+            if (!shaded(k)) return;
+            const Intersection& inter = gbuffer[k];
+            const Vector3f& wo = rays[k].direction;
+
+            Reservoir fresh;
+            for (int c = 0; c < restirCandidates; ++c) {
+                Intersection pos;
+                float pdf = 0;
+                scene.sampleLight(inter.coords, inter.normal, pos, pdf);
+                LightSample s{pos.coords, pos.normal, pos.emit};
+                fresh.update(s, pdf > 0 ? targetPdf(inter, wo, s) / pdf : 0, get_random_float());
+            }
+            finalizeReservoir(fresh, targetPdf(inter, wo, fresh.y));
+
+            Reservoir& r = temporal[k];
+            r.merge(fresh, targetPdf(inter, wo, fresh.y), get_random_float());
+            if (prev[k].M > 0) {
+                Reservoir history = prev[k];
+                history.M = std::min(history.M, restirHistory * fresh.M);
+                r.merge(history, targetPdf(inter, wo, history.y), get_random_float());
+            }
+            finalizeReservoir(r, targetPdf(inter, wo, r.y));
+        });
+
+        //空间复用
+        forEachPixel(pass, 1, [&](int k) {
+            spatial[k] = Reservoir();
+            if (!shaded(k)) return;
+            const Intersection& inter = gbuffer[k];
+            const Vector3f& wo = rays[k].direction;
+            int i = k % width, j = k / width;
+
+            Reservoir& r = spatial[k];
+            r.merge(temporal[k], targetPdf(inter, wo, temporal[k].y), get_random_float());
+            for (int nb = 0; nb < restirNeighbors; ++nb) {
+                float radius = restirRadius * std::sqrt(get_random_float()), phi = 2 * M_PI * get_random_float();
+                int qi = i + int(std::round(radius * std::cos(phi))), qj = j + int(std::round(radius * std::sin(phi)));
+                if (qi < 0 || qi >= width || qj < 0 || qj >= height) continue;
+                int q = qj * width + qi;
+                if (q == k || !shaded(q)) continue;
+                //法向量夹角超过约25度或深度相差超过10%的邻居不参与复用
+                if (dotProduct(gbuffer[q].normal, inter.normal) < 0.9f ||
+                    std::fabs(gbuffer[q].distance - inter.distance) > 0.1f * inter.distance)
+                    continue;
+                r.merge(temporal[q], targetPdf(inter, wo, temporal[q].y), get_random_float());
+            }
+            finalizeReservoir(r, targetPdf(inter, wo, r.y));
+        });
+
+        //着色：每个像素一条阴影光线
+        forEachPixel(pass, 2, [&](int k) {
+            const Intersection& inter = gbuffer[k];
+            if (!inter.happened) return;
+            if (inter.m->hasEmission()) {
+                framebuffer[k] += inter.m->getEmission() / restirPasses;
+                return;
+            }
+            Vector3f L_dir(0, 0, 0);
+            const Reservoir& r = spatial[k];
+            if (r.W > 0) {
+                Vector3f object2light = r.y.coords - inter.coords;
+                Ray light(inter.coords, normalize(object2light));
+                Intersection object2lightInter = scene.intersect(light);
+                if (object2lightInter.happened && (object2lightInter.coords - r.y.coords).norm() < 0.1)
+                    L_dir = lightContribution(inter, rays[k].direction, r.y) * r.W;
+            }
+            Vector3f L_indir = scene.indirectLight(inter, rays[k], 0);
+            framebuffer[k] += (L_dir + L_indir) / restirPasses;
+        });
+
+        prev.swap(spatial);
+        if (!job.finishPass(framebuffer, pass + 1, restirPasses)) return;
+    }
+}
+
+/*
+**波前式路径追踪：每一遍把所有像素的光线按深度分批推进，每一批的阴影光线和延伸光线各自收集起来
+**经Scene的批量查询集中求交，查询在线程池上按块排序后遍历，相邻求交的光线在BVH中走相近的路径(见RayQueue)
+**与castRay使用相同的估计(光源采样 + 材质采样 + 俄罗斯轮盘赌)；辐射度缓存和路径引导的记录不在这个模式中使用
+*/
+void Renderer::RenderWavefront(const Scene& scene, RenderJob& job)
+{
+    std::vector<Vector3f> framebuffer(job.width * job.height);
+    struct PathState {
+        uint32_t pixel;
+        Ray ray;
+        Vector3f throughput;
+        Intersection inter;
+    };
+
+    std::vector<Ray> extension, shadow;
+    std::vector<Hit> batch;
+    std::vector<Intersection> hits;
+    //批量求交后为每个命中计算完整的相交数据，hits[k]对应rays[k]
+    auto trace = [&](const std::vector<Ray>& rays) {
+        batch.assign(rays.size(), Hit());
+        scene.intersect(std::span<const Ray>(rays), std::span<Hit>(batch));
+        hits.assign(rays.size(), Intersection());
+        for (size_t k = 0; k < rays.size(); ++k)
+            if (batch[k].happened()) hits[k] = batch[k].obj->getSurfaceInteraction(rays[k], batch[k]);
+    };
+    std::vector<PathState> paths, next;
+    std::vector<uint32_t> shadowPixel;
+    std::vector<Vector3f> shadowL, shadowTarget;
+
+    std::cout << "SPP: " << spp << " (wavefront)\n";
+    for (int pass = 0; pass < spp; ++pass) {
+        seed_random(seed, pass);
+        //主光线
+        extension.clear();
+        for (int j = 0; j < job.height; ++j)
+            for (int i = 0; i < job.width; ++i)
+                extension.push_back(job.camera.generateRay(i, j));
+        trace(extension);
+        paths.clear();
+        for (uint32_t k = 0; k < hits.size(); ++k) {
+            if (!hits[k].happened) continue;
+            if (hits[k].m->hasEmission())
+                framebuffer[k] += hits[k].m->getEmission() / spp;
+            else
+                paths.push_back({k, extension[k], Vector3f(1), hits[k]});
+        }
+
+        while (!paths.empty()) {
+            shadow.clear();
+            shadowPixel.clear();
+            shadowL.clear();
+            shadowTarget.clear();
+            extension.clear();
+            next.clear();
+            for (auto& path : paths) {
+                const Intersection& inter = path.inter;
+                //对光源采样，阴影光线先击中光源采样点附近时才计入
+                Intersection lightInter;
+                float pdf = 0;
+                scene.sampleLight(inter.coords, inter.normal, lightInter, pdf);
+                if (pdf > 0) {
+                    Vector3f L = lightContribution(inter, path.ray.direction, {lightInter.coords, lightInter.normal, lightInter.emit});
+                    shadow.push_back(Ray(inter.coords, normalize(lightInter.coords - inter.coords)));
+                    shadowPixel.push_back(path.pixel);
+                    shadowL.push_back(path.throughput * L / pdf);
+                    shadowTarget.push_back(lightInter.coords);
+                }
+
+                //俄罗斯轮盘赌 + 按材质采样延伸光线
+                if (get_random_float() >= scene.RussianRoulette) continue;
+                Vector3f wo;
+                float bouncePdf;
+                if (!scene.sampleBounce(inter, path.ray.direction, wo, bouncePdf)) continue;
+                Vector3f f = inter.m->eval(path.ray.direction, wo, inter.normal) * dotProduct(wo, inter.normal);
+                extension.push_back(Ray(inter.coords, wo));
+                next.push_back({path.pixel, extension.back(), path.throughput * f / bouncePdf / scene.RussianRoulette, Intersection()});
+            }
+
+            trace(shadow);
+            for (size_t k = 0; k < hits.size(); ++k)
+                if (hits[k].happened && (hits[k].coords - shadowTarget[k]).norm() < 0.1)
+                    framebuffer[shadowPixel[k]] += shadowL[k] / spp;
+
+            //间接光照只统计非自发光的交点，光源的贡献已由光源采样计入
+            trace(extension);
+            paths.clear();
+            for (size_t k = 0; k < hits.size(); ++k)
+                if (hits[k].happened && !hits[k].m->hasEmission()) {
+                    next[k].inter = hits[k];
+                    paths.push_back(next[k]);
+                }
+        }
+        if (!job.finishPass(framebuffer, pass + 1, spp)) return;
     }
-    fclose(fp);    
 }
@@ -1,5 +1,15 @@
 #pragma once
+#include <atomic>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include "Scene.hpp"
+#include "Camera.hpp"
+#include "OutputSink.hpp"
+#include "Checkpoint.hpp"
+#include "Denoiser.hpp"
 struct hit_payload
 {
     float tNear;
@@ -8,10 +18,208 @@ struct hit_payload
     Object* hit_obj;
 };
 
+/*
+**光源上的一个采样点：位置、法向量和自发光
+*/
+struct LightSample
+{
+    Vector3f coords;
+    Vector3f normal;
+    Vector3f emit;
+};
+
+/*
+**加权蓄水池采样：依次输入候选y_i及权重w_i，最终保留的y被选中的概率为w_i / wSum
+**M为见过的候选数，W = wSum / (M * p_hat(y))为保留样本的无偏贡献权重
+*/
+struct Reservoir
+{
+    LightSample y;
+    float wSum = 0;
+    float M = 0;
+    float W = 0;
+
+    bool update(const LightSample& s, float w, float u)
+    {
+        wSum += w;
+        M += 1;
+        if (w > 0 && u * wSum < w) {
+            y = s;
+            return true;
+        }
+        return false;
+    }
+
+    //合并另一个蓄水池r，pHat为r.y在当前像素处的目标函数值
+    bool merge(const Reservoir& r, float pHat, float u)
+    {
+        float w = pHat * r.W * r.M;
+        M += r.M;
+        wSum += w;
+        if (w > 0 && u * wSum < w) {
+            y = r.y;
+            return true;
+        }
+        return false;
+    }
+};
+
+class Coordinator;
+
+/*
+**增量渲染的状态，由调用者保存并通过Renderer::incremental传给默认模式的渲染：
+**渲染时记录每个图块中所有路径(包括阴影光线)命中过的物体(按sceneId的位集)和最终图像
+**修改材质或物体后调用invalidate，下一次渲染只重新渲染位集中含有被修改物体的图块，其余图块直接复制上一次的结果
+**由于每个样本的随机数只由(seed, 像素, 样本序号)决定，结果与修改后完整渲染逐位相同
+**以下修改会影响没有碰到该物体的路径，需要invalidateAll：自发光的变化(光源的选择概率随之改变，还要重建光源BVH)、
+**物体的移动、增删(可能挡住原本没有碰到它的光线)；相机、分辨率、spp、seed、tileSize或crop变化时自动完整渲染
+*/
+struct TileDependencies
+{
+    void invalidate(const Object* object);
+    //使用material的所有物体；material有自发光时等同于invalidateAll
+    void invalidate(const Scene& scene, Material* material);
+    void invalidateAll() { valid = false; }
+
+private:
+    friend class Renderer;
+    bool valid = false;
+    Camera camera;
+    int spp = 0, tileSize = 0;
+    uint64_t seed = 0;
+    std::optional<TileRect> crop;
+    std::vector<Vector3f> image;
+    std::vector<std::vector<uint64_t>> touched;//每个图块命中过的物体
+    std::vector<uint64_t> dirty;//被修改的物体
+};
+
+/*
+**异步渲染任务的句柄，由Renderer::RenderAsync返回
+**取消是协作式的：渲染循环在每个图块(按遍渲染的模式为每一遍)开始前检查，已开始的图块会先完成
+**snapshot可在渲染过程中随时调用，返回已完成部分的图像
+*/
+class RenderJob
+{
+public:
+    //keepImage为false时不分配帧缓冲和样本数(逐图块输出)，snapshot和sampleCounts返回空
+    explicit RenderJob(const Camera& camera, bool keepImage = true)
+        : camera(camera), width(camera.width), height(camera.height), framebuffer(keepImage ? size_t(width) * height : 0),
+          sampleCount(keepImage ? size_t(width) * height : 0) {}
+
+    float progress() const { return progressValue.load(); }
+    void cancel() { cancelRequested.store(true); }
+    bool cancelled() const { return cancelRequested.load(); }
+    bool done() const { return result.wait_for(std::chrono::seconds(0)) == std::future_status::ready; }
+    //等待渲染结束：全部完成返回true，被取消返回false；渲染或输出中抛出的异常在这里重新抛出
+    bool wait();
+    //当前图像的副本：默认模式下未完成的图块为0，按遍渲染的模式为已完成各遍的平均
+    std::vector<Vector3f> snapshot() const;
+    //每个像素已完成的样本数(默认模式和限时模式)
+    std::vector<uint32_t> sampleCounts() const;
+
+    const Camera camera;
+    const int width, height;
+    std::function<void(float)> onProgress;//进度回调，参数在[0, 1]；在渲染线程中调用，同一时刻只有一个调用
+    std::shared_ptr<OutputSink> sink;//渲染全部完成后写出图像，为空时不输出
+    std::shared_ptr<TileSink> tileSink;//非空时每个图块完成后立即写出
+
+private:
+    friend class Renderer;
+    friend class Coordinator;
+    //把完成的图块写入帧缓冲、记录每个像素的样本数并报告进度；返回false表示已被取消
+    bool finishTile(int x0, int y0, int x1, int y1, const std::vector<Vector3f>& tile, uint32_t samples, int tileCount);
+    //accum为前done遍(每遍权重1/total)的累加结果
+    bool finishPass(const std::vector<Vector3f>& accum, int done, int total);
+    void report(float p);
+
+    std::vector<Vector3f> framebuffer;
+    mutable std::mutex mutex;//保护framebuffer、tilesDone和onProgress的调用
+    std::vector<uint32_t> sampleCount;//每个像素已完成的样本数(默认模式和限时模式)
+    int tilesDone = 0;
+
+    std::mutex checkpointMutex;//同一时刻只有一个线程发起检查点
+    std::future<void> checkpointWriter;//后台写检查点的任务
+    std::atomic<std::chrono::steady_clock::rep> lastCheckpoint{0};//上一次检查点的时刻(steady_clock的计数)，各图块线程无锁读取
+    std::atomic<float> progressValue{0};
+    std::atomic<bool> cancelRequested{false};
+    bool completed = false;
+    std::shared_future<void> result;
+};
+
 class Renderer
 {
 public:
+    //阻塞渲染：进度条输出到stdout，结果写入工作目录下的binary.ppm
     void Render(const Scene& scene);
+    //在后台线程中渲染，立即返回；渲染使用调用时Renderer设置的副本，scene在任务结束前必须保持有效
+    std::shared_ptr<RenderJob> RenderAsync(const Scene& scene, std::shared_ptr<OutputSink> sink,
+                                           std::function<void(float)> onProgress = {}) const;
+    /*
+    **多视点批量渲染：同一个场景和BVH依次从cameras中的每个视点渲染，sinks[v]为第v个视点的输出(可为空)
+    **所有视点的图块按视点顺序放进同一个parallelFor，前一个视点最后几个图块渲染时空闲线程已开始下一个视点，线程池始终满载
+    **每个视点的帧缓冲在取到它的第一个图块时分配，图块全部完成后立即写出并释放，不等其他视点；onProgress报告所有视点合计的进度
+    **只用于默认模式，不写检查点也不使用coordinator；开启ReSTIR、wavefront或路径引导时逐个视点调用RenderAsync
+    */
+    void RenderBatch(const Scene& scene, const std::vector<Camera>& cameras,
+                     const std::vector<std::shared_ptr<OutputSink>>& sinks, std::function<void(float)> onProgress = {}) const;
+    /*
+    **动画序列：第f帧先调用advance(f)移动物体(如MeshTriangle::deform)并返回该帧的相机，随后refit顶层BVH再渲染
+    **sink(f)返回第f帧的输出(可为空)。主光线命中静止物体、且重投影到上一帧后仍是同一物体同一位置的像素，
+    **只追踪temporalSpp个样本并与上一帧的结果按样本数加权累加；其余像素(新露出的、动态物体上的)追踪完整的spp
+    **新样本与历史明显不符的像素(动态物体的阴影扫过等)同样丢弃历史、追踪完整的spp
+    */
+    void RenderSequence(Scene& scene, int frames, const std::function<Camera(int)>& advance,
+                        const std::function<std::shared_ptr<OutputSink>(int)>& sink,
+                        std::function<void(float)> onProgress = {}) const;
+    //按默认模式渲染一个图块，结果按行存储；start非空时从检查点中记录的累加值和样本数继续
+    std::vector<Vector3f> renderTile(const Scene& scene, const Camera& camera, const TileRect& rect,
+                                     const Checkpoint* start = nullptr) const;
+
+    std::optional<Camera> camera;//未设置时使用scene的width、height、fov和默认视点
+    int spp = 64;//每个像素的采样数
+    int tileSize = 16;//默认模式按tileSize x tileSize的图块分给线程池
+    uint64_t seed = 0;//每个(像素, 样本)的随机数种子由它派生，相同的设置得到逐位相同的图像(开启辐射度缓存时除外)
+
+    //检查点(只用于默认模式)：定期在后台把累加缓冲和样本数写入checkpointPath，结束或取消时再写一次
+    std::string checkpointPath;//为空时不写检查点
+    double checkpointInterval = 60;//两次检查点之间的最短间隔(秒)
+    bool resume = false;//从checkpointPath继续，结果与不中断的渲染逐位相同
+
+    Coordinator* coordinator = nullptr;//非空时默认模式的图块交给coordinator连接的worker渲染，见Distributed.hpp
+    std::optional<TileRect> crop;//默认模式只渲染图像中的这个区域，其余像素为0
+    TileDependencies* incremental = nullptr;//非空时默认模式只重新渲染受修改影响的图块(不与coordinator同时使用)
+    //非空时默认模式把完成的图块直接写入tileSink，不保存整幅图像，用于超高分辨率；RenderAsync的sink被忽略
+    //不能与检查点、增量渲染、降噪同时使用(它们都需要整幅图像)
+    std::shared_ptr<TileSink> tileSink;
+    int guideTrainingPasses = 16;//开启路径引导时，前若干遍边渲染边训练引导分布
+
+    //ReSTIR直接光照：每个像素从光源BVH取若干候选，经时间(上一遍)与空间(邻近像素)复用后只追踪一条阴影光线
+    bool restir = false;
+    int restirPasses = 16;//渐进渲染的遍数，每遍每个像素一条主光线
+    int restirCandidates = 16;//每个像素每遍新生成的候选数
+    int restirNeighbors = 5;//空间复用的邻近像素数
+    float restirRadius = 10;//空间复用的像素半径
+    int restirHistory = 20;//上一遍蓄水池的M最多为当前的restirHistory倍
+
+    bool wavefront = false;//按深度分批推进所有像素的路径，每批光线排序后集中求交
+
+    std::optional<Denoiser> denoiser;//非空时渲染完成后按AOV引导降噪，RenderJob的图像和输出都是降噪后的结果
+
+    //限时模式：大于0时不按spp而按墙钟时间(秒)渐进渲染，每遍每个像素一个样本，时间到后不再开始新的图块
+    //第一遍总是完整渲染，图像中没有空白像素；结束时报告达到的spp和每秒光线数
+    double timeBudget = 0;
+
+    //序列模式的时间复用
+    int temporalSpp = 8;//可复用上一帧的像素每帧追踪的样本数
+    int temporalHistory = 0;//历史最多按这么多样本计权，0表示spp；限制动态物体的阴影等间接变化留下的拖尾
+    float temporalReject = 0.3f;//新样本与历史的亮度差超过两者之和的这个比例时丢弃历史，按完整的spp重新渲染该像素
 
 private:
+    void RenderTiles(const Scene& scene, RenderJob& job);
+    //background为true时若上一次还没写完则跳过，否则等待写完
+    void saveCheckpoint(RenderJob& job, bool background) const;
+    void RenderGuided(const Scene& scene, RenderJob& job);
+    void RenderReSTIR(const Scene& scene, RenderJob& job);
+    void RenderWavefront(const Scene& scene, RenderJob& job);
+    void RenderBudget(const Scene& scene, RenderJob& job);
 };
@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <cassert>
 #include "Scene.hpp"
 
 /*
@@ -5,10 +7,58 @@
 */
 void Scene::buildBVH() {
     printf(" - Generating BVH...\n\n");
-    this->bvh = new BVHAccel(objects, 1, BVHAccel::SplitMethod::NAIVE);
+    this->bvh = new BVHAccel(objects, 1, BVHAccel::SplitMethod::NAIVE, lazyBVHDepth);
     //objects形参来源于Scene类型中的数据成员，其内包含了scene内的全部object
     //第二个形参 1 表示每个包围盒内仅包含一个物体
     //NAIVE指BVH中对物体的划分方法
+    buildLightBVH();
+}
+
+/*
+**为场景中的发光体创建光源BVH树；光源数量通常远小于物体数量，物体变化时直接重建
+*/
+void Scene::buildLightBVH()
+{
+    delete lightBVH;
+    lightBVH = new LightBVH(objects);
+    printf(" - Light BVH: %zu emitters, %zu nodes\n", lightBVH->lights.size(), lightBVH->nodes.size());
+}
+
+void Scene::refitBVH()
+{
+    if (bvh) bvh->refit();
+    if (lightBVH) buildLightBVH();
+}
+
+void Scene::Insert(Object *object)
+{
+    object->sceneId = objects.size();
+    objects.push_back(object);
+    if (bvh) bvh->insert(object);
+    if (lightBVH && object->hasEmit()) buildLightBVH();
+}
+
+void Scene::Remove(Object *object)
+{
+    objects.erase(std::remove(objects.begin(), objects.end(), object), objects.end());
+    object->sceneId = UINT32_MAX;
+    for (size_t k = 0; k < objects.size(); ++k)
+        objects[k]->sceneId = k;
+    if (bvh) bvh->remove(object);
+    if (lightBVH && object->hasEmit()) buildLightBVH();
+}
+
+static thread_local uint64_t rayCount = 0;
+static thread_local std::vector<uint64_t>* touchedObjects = nullptr;
+
+uint64_t Scene::threadRayCount()
+{
+    return rayCount;
+}
+
+void Scene::recordTouched(std::vector<uint64_t>* touched)
+{
+    touchedObjects = touched;
 }
 
 /*
@@ -16,7 +66,14 @@ void Scene::buildBVH() {
 */
 Intersection Scene::intersect(const Ray &ray) const
 {
-    return this->bvh->Intersect(ray);
+    ++rayCount;
+    Intersection inter = this->bvh->Intersect(ray);
+    if (touchedObjects && inter.happened && inter.obj->sceneId < objects.size()) {
+        uint32_t id = inter.obj->sceneId;
+        if (touchedObjects->size() <= id / 64) touchedObjects->resize(id / 64 + 1);
+        (*touchedObjects)[id / 64] |= uint64_t(1) << (id % 64);
+    }
+    return inter;
 }
 
 /*
@@ -30,6 +87,7 @@ void Scene::sampleLight(Intersection &pos, float &pdf) const
             emit_area_sum += objects[k]->getArea();//将当前物体的采样面积加入总面积中
         }
     }
+    float total_area = emit_area_sum;
     float p = get_random_float() * emit_area_sum;//为什么要乘以随机数？
     emit_area_sum = 0;
     for (uint32_t k = 0; k < objects.size(); ++k) {//遍历所有物体
@@ -37,12 +95,23 @@ void Scene::sampleLight(Intersection &pos, float &pdf) const
             emit_area_sum += objects[k]->getArea();
             if (p <= emit_area_sum){
                 objects[k]->Sample(pos, pdf);
+                pdf *= objects[k]->getArea() / total_area;//选中该物体的概率为其面积占比
                 break;
             }
         }
     }
 }
 
+void Scene::sampleLight(const Vector3f &p, const Vector3f &N, Intersection &pos, float &pdf) const
+{
+    if (!useLightBVH || !lightBVH) {
+        sampleLight(pos, pdf);
+        return;
+    }
+    if (!lightBVH->Sample(p, N, pos, pdf))
+        pdf = 0;
+}
+
 /*
 **找到与光线相交的物体，从中选择距离最近的相交点及被击中的物体
 */
@@ -84,12 +153,18 @@ Vector3f Scene::castRay(const Ray &ray, int depth) const
         return inter.m->getEmission();//返回自发光：数据成员Vector3f m_emission
     }
 
+    //第一次漫反射之后的顶点：缓存中样本足够时直接取缓存的出射辐射度，否则正常计算并写入缓存
+    bool cacheable = radianceCache && depth >= 1 && inter.m->getType() == DIFFUSE;
+    Vector3f L_cached;
+    if (cacheable && radianceCache->lookup(inter.coords, inter.normal, L_cached))
+        return L_cached;
+
     //对光源采样
     Intersection lightInter;
     float pdf_light = 0.0f;
-    sampleLight(lightInter, pdf_light);
-
     Vector3f normal = inter.normal;//被击中物体的法向量
+    sampleLight(inter.coords, normal, lightInter, pdf_light);
+
     Vector3f object2light = lightInter.coords-inter.coords;//向量，由BVH与光线的相交点指向光源
     float objectLight_distance = object2light.norm();//对object2light取向量距离的平方
     object2light = object2light.normalized();//object2light向量归一化
@@ -99,30 +174,97 @@ Vector3f Scene::castRay(const Ray &ray, int depth) const
     Intersection object2lightInter = intersect(light);//发射light，找到其与BVH树的交点(有问题)
 
     // if light ray hit light source directly
-    if(object2lightInter.happened && (object2lightInter.coords-lightInter.coords).norm()<0.1)
+    if(pdf_light > 0 && object2lightInter.happened && (object2lightInter.coords-lightInter.coords).norm()<0.1)
     {
         // L_dir = emit * eval (wo , ws , N) * dot (ws , N) * dot (ws ,NN) / |x-p |^2 / pdf_light
         L_dir = lightInter.emit*inter.m->eval(ray.direction, object2light, normal)*dotProduct(object2light, normal)*dotProduct(-object2light, lightInter.normal)/(objectLight_distance*objectLight_distance)/pdf_light;
     }
 
 
+    L_indir = indirectLight(inter, ray, depth);
+    if (cacheable)
+        radianceCache->add(inter.coords, inter.normal, L_dir + L_indir);
+    return L_dir + L_indir;
+}
+
+/*
+**在交点inter处为间接光照采样出射方向wo，pdf为对应的概率密度；wo在表面以下时返回false
+**开启路径引导时以guidedFraction的概率按引导分布采样，pdf为两种采样方式的混合
+*/
+bool Scene::sampleBounce(const Intersection &inter, const Vector3f &wi, Vector3f &wo, float &pdf) const
+{
+    const Vector3f &normal = inter.normal;
+    float guidePdf = 0;
+    bool guided = pathGuide && get_random_float() < pathGuide->guidedFraction &&
+                  pathGuide->sample(inter.coords, get_random_float(), get_random_float(), wo, guidePdf);
+    if (!guided)
+        wo = inter.m->sample(wi, normal).normalized();
+    pdf = inter.m->pdf(wi, wo, normal);
+    if (pathGuide && (guidePdf = pathGuide->pdf(inter.coords, wo)) > 0)
+        pdf = pathGuide->guidedFraction * guidePdf + (1 - pathGuide->guidedFraction) * pdf;
+    return dotProduct(wo, normal) > 0 && pdf > 0;
+}
+
+/*
+**批量求交：每块光线经RayQueue按方向卦限和起点Morton码排序后遍历，hits[i]对应rays[i]
+*/
+void Scene::intersect(std::span<const Ray> rays, std::span<Hit> hits) const
+{
+    assert(hits.size() >= rays.size());
+    Bounds3 bounds = bvh->WorldBound();
+    ThreadPool::shared().parallelFor(rays.size(), batchGrain, [&](size_t begin, size_t end) {
+        RayQueue queue(bounds);
+        for (uint32_t i : queue.sort(rays.data() + begin, end - begin)) {
+            Hit hit;
+            bvh->IntersectHit(rays[begin + i], hit);
+            hits[begin + i] = hit;
+        }
+    });
+}
+
+void Scene::occluded(std::span<const Ray> rays, std::span<uint8_t> occluded) const
+{
+    assert(occluded.size() >= rays.size());
+    Bounds3 bounds = bvh->WorldBound();
+    ThreadPool::shared().parallelFor(rays.size(), batchGrain, [&](size_t begin, size_t end) {
+        RayQueue queue(bounds);
+        for (uint32_t i : queue.sort(rays.data() + begin, end - begin))
+            occluded[begin + i] = bvh->IntersectP(rays[begin + i]);
+    });
+}
+
+/*
+**交点inter处的间接光照：按材质采样一条出射光线，俄罗斯轮盘赌决定是否继续递归
+*/
+Vector3f Scene::indirectLight(const Intersection &inter, const Ray &ray, int depth) const
+{
+    Vector3f L_indir(0,0,0);
+    Vector3f normal = inter.normal;
+
     // hit other object
     // RR--get_random_float will directly return a float in 0-1
     if(get_random_float() < RussianRoulette)
     {
         // construct out ray
         // from object, sample object-0>outside 
-        Vector3f outDirection = inter.m->sample(ray.direction, normal).normalized();
+        Vector3f outDirection;
+        float pdf;
+        if (!sampleBounce(inter, ray.direction, outDirection, pdf))
+            return L_indir;
+
         Ray outRay(inter.coords, outDirection);
         Intersection outRayInter = intersect(outRay);
 
         // if out ray hit something but not light source--indirectly
         if(outRayInter.happened && !outRayInter.m->hasEmission())
         {
+            Vector3f L_i = castRay(outRay, depth+1);
+            if (pathGuide)
+                pathGuide->record(inter.coords, outDirection, (L_i.x + L_i.y + L_i.z) / 3, pdf);
             // L_indir = shade (q, wi) * eval (wo , wi , N) * dot (wi , N)/ pdf (wo , wi , N) / RussianRoulette
-            L_indir = castRay(outRay, depth+1)*inter.m->eval(ray.direction, outDirection, normal)*dotProduct(outDirection, normal)/inter.m->pdf(ray.direction, outDirection, normal)/RussianRoulette;
+            L_indir = L_i*inter.m->eval(ray.direction, outDirection, normal)*dotProduct(outDirection, normal)/pdf/RussianRoulette;
             // note: when we recursively call this funtion, depth+=1
         }
     }
-    return L_dir + L_indir;
+    return L_indir;
 }
\ No newline at end of file
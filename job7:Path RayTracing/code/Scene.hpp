@@ -1,11 +1,19 @@
 #pragma once
+#include <memory>
+#include <span>
 #include <vector>
 #include "Vector.hpp"
 #include "Object.hpp"
 #include "Light.hpp"
 #include "AreaLight.hpp"
 #include "BVH.hpp"
+#include "LightBVH.hpp"
+#include "RadianceCache.hpp"
+#include "PathGuide.hpp"
+#include "RayQueue.hpp"
+#include "ThreadPool.hpp"
 #include "Ray.hpp"
+#include "Camera.hpp"
 
 class Scene
 {
@@ -16,20 +24,49 @@ public:
     Vector3f backgroundColor = Vector3f(0.235294, 0.67451, 0.843137);
     int maxDepth = 1;
     float RussianRoulette = 0.8;//俄罗斯轮盘赌，用于决定递归停止的时机
+    int lazyBVHDepth = 0;//大于0时顶层BVH树延迟构建，只预先构建前lazyBVHDepth层
+    std::unique_ptr<RadianceCache> radianceCache;//不为空时，第一次漫反射之后的路径可以终止于缓存的辐射度
+    std::unique_ptr<PathGuide> pathGuide;//不为空时，间接光照的方向采样混合学习到的入射辐射度分布
 
     Scene(int w, int h) : width(w), height(h){}
 
-    void Add(Object *object) { objects.push_back(object); }
+    void Add(Object *object)
+    {
+        object->sceneId = objects.size();
+        objects.push_back(object);
+    }
     void Add(std::unique_ptr<Light> light) { lights.push_back(std::move(light)); }
     const std::vector<Object*>& get_objects() const { return objects; }
     const std::vector<std::unique_ptr<Light> >&  get_lights() const { return lights; }
 
     Intersection intersect(const Ray& ray) const;
+    //当前线程调用intersect(const Ray&)追踪过的光线数，用于统计吞吐量
+    static uint64_t threadRayCount();
+    //非空时，当前线程此后intersect(const Ray&)命中的物体在touched中按sceneId置位(见TileDependencies)
+    static void recordTouched(std::vector<uint64_t>* touched);
+    //批量查询，供可见性、AO烘焙、碰撞探测等外部工具使用：每batchGrain条光线为一块分给共享线程池，块内经RayQueue排序后遍历
+    //hits[i]为rays[i]的最近命中(未命中时obj为空)，需要完整相交数据时调用hits[i].obj->getSurfaceInteraction
+    void intersect(std::span<const Ray> rays, std::span<Hit> hits) const;
+    //occluded[i]为1表示rays[i]在(0, t_max)内被遮挡，阴影光线应把t_max设为到目标点的距离(略小一点)
+    void occluded(std::span<const Ray> rays, std::span<uint8_t> occluded) const;
+    size_t batchGrain = 4096;
 
-    BVHAccel *bvh;//BVH树操作类型
+    BVHAccel *bvh = nullptr;//BVH树操作类型
     void buildBVH();
+    //动态场景：物体变形/移动后refit顶层BVH树；插入、删除物体时局部更新BVH树
+    void refitBVH();
+    void Insert(Object *object);
+    void Remove(Object *object);
     Vector3f castRay(const Ray &ray, int depth) const;
+    Vector3f indirectLight(const Intersection &inter, const Ray &ray, int depth) const;
+    bool sampleBounce(const Intersection &inter, const Vector3f &wi, Vector3f &wo, float &pdf) const;
     void sampleLight(Intersection &pos, float &pdf) const;
+
+    LightBVH *lightBVH = nullptr;//发光体的层次结构，用于按着色点的贡献估计选择光源
+    bool useLightBVH = true;//false时按面积选择光源
+    void buildLightBVH();
+    //对着色点p(法向量N)采样光源，照不到p时pdf为0
+    void sampleLight(const Vector3f &p, const Vector3f &N, Intersection &pos, float &pdf) const;
     bool trace(const Ray &ray, const std::vector<Object*> &objects, float &tNear, uint32_t &index, Object **hitObject);
     std::tuple<Vector3f, Vector3f> HandleAreaLight(const AreaLight &light, const Vector3f &hitPoint, const Vector3f &N,
                                                    const Vector3f &shadowPointOrig,
@@ -86,4 +123,15 @@ public:
         // As a consequence of the conservation of energy, transmittance is given by:
         // kt = 1 - kr;
     }
-};
\ No newline at end of file
+};
+
+/*
+**拥有物体和材质的场景：Scene只保存物体指针，由代码或场景文件构建、需要长期保存的场景把所有权放在这里
+*/
+struct SceneBundle
+{
+    std::unique_ptr<Scene> scene;
+    Camera camera;//场景的默认视点，分辨率与scene的width、height相同
+    std::vector<std::unique_ptr<Material>> materials;
+    std::vector<std::unique_ptr<Object>> objects;
+};
@@ -0,0 +1,167 @@
+#include <chrono>
+#include <exception>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include "OutOfCoreMesh.hpp"
+#include "SceneFile.hpp"
+#include "Triangle.hpp"
+
+namespace {
+
+//一个mesh语句：在线程池上构建，构建完成后施加变换
+struct MeshEntry
+{
+    std::string file;
+    Material* material;
+    float scale = 1;
+    Vector3f offset = Vector3f(0);
+    double optimize = 0;//大于0时构建后用树旋转优化网格BVH，值为时间预算(秒)
+    int lazy = 0;//大于0时网格BVH延迟构建(MeshTriangle的lazyDepth)
+    std::string pageFile;//非空时作为外存网格加载(OutOfCoreMesh)
+};
+
+Vector3f readVector(std::istringstream& in, const std::string& key)
+{
+    float x, y, z;
+    if (!(in >> x >> y >> z)) throw std::runtime_error("expected 3 numbers after " + key);
+    return Vector3f(x, y, z);
+}
+
+}
+
+SceneBundle loadSceneFile(const std::string& path, Renderer* settings)
+{
+    std::ifstream file(path);
+    if (!file) throw std::runtime_error("cannot open scene file " + path);
+    std::string directory = path.substr(0, path.find_last_of('/') + 1);
+
+    SceneBundle bundle;
+    std::map<std::string, Material*> materials;
+    std::vector<MeshEntry> meshes;
+    int spp = 0;
+    std::optional<uint64_t> seed;
+
+    std::string line;
+    for (int lineNo = 1; std::getline(file, line); ++lineNo) {
+        try {
+            std::istringstream in(line.substr(0, line.find('#')));
+            std::string key;
+            if (!(in >> key)) continue;
+            if (key == "size") {
+                if (!(in >> bundle.camera.width >> bundle.camera.height) || bundle.camera.width <= 0 || bundle.camera.height <= 0)
+                    throw std::runtime_error("bad size");
+            } else if (key == "camera") {
+                std::string part;
+                while (in >> part) {
+                    if (part == "eye") bundle.camera.eye = readVector(in, part);
+                    else if (part == "target") bundle.camera.target = readVector(in, part);
+                    else if (part == "up") bundle.camera.up = readVector(in, part);
+                    else if (part == "fov") {
+                        if (!(in >> bundle.camera.fov)) throw std::runtime_error("bad fov");
+                    }
+                    else throw std::runtime_error("unknown camera parameter " + part);
+                }
+            } else if (key == "spp") {
+                if (!(in >> spp) || spp <= 0) throw std::runtime_error("bad spp");
+            } else if (key == "seed") {
+                uint64_t value;
+                if (!(in >> value)) throw std::runtime_error("bad seed");
+                seed = value;
+            } else if (key == "material") {
+                std::string name, part;
+                if (!(in >> name)) throw std::runtime_error("missing material name");
+                if (materials.count(name)) throw std::runtime_error("duplicate material " + name);
+                bundle.materials.push_back(std::make_unique<Material>(DIFFUSE));
+                Material* m = bundle.materials.back().get();
+                while (in >> part) {
+                    if (part == "kd") m->Kd = readVector(in, part);
+                    else if (part == "emission") m->m_emission = readVector(in, part);
+                    else throw std::runtime_error("unknown material parameter " + part);
+                }
+                materials[name] = m;
+            } else if (key == "mesh") {
+                MeshEntry mesh;
+                std::string name, part;
+                if (!(in >> mesh.file >> name)) throw std::runtime_error("expected mesh <file> <material>");
+                auto it = materials.find(name);
+                if (it == materials.end()) throw std::runtime_error("unknown material " + name);
+                mesh.material = it->second;
+                if (mesh.file.front() != '/') mesh.file = directory + mesh.file;
+                while (in >> part) {
+                    if (part == "scale") {
+                        if (!(in >> mesh.scale)) throw std::runtime_error("bad scale");
+                    }
+                    else if (part == "translate") mesh.offset = readVector(in, part);
+                    else if (part == "lazy") {
+                        if (!(in >> mesh.lazy) || mesh.lazy <= 0) throw std::runtime_error("bad lazy depth");
+                    }
+                    else if (part == "optimize") {
+                        if (!(in >> mesh.optimize) || mesh.optimize <= 0) throw std::runtime_error("bad optimize");
+                    }
+                    else if (part == "outofcore") {
+                        if (!(in >> mesh.pageFile)) throw std::runtime_error("expected outofcore <page file>");
+                        if (mesh.pageFile.front() != '/') mesh.pageFile = directory + mesh.pageFile;
+                    }
+                    else throw std::runtime_error("unknown mesh parameter " + part);
+                }
+                //已有页文件的外存网格不再读取obj文件
+                if ((mesh.pageFile.empty() || !std::ifstream(mesh.pageFile)) && !std::ifstream(mesh.file))
+                    throw std::runtime_error("cannot open " + mesh.file);
+                meshes.push_back(mesh);
+            } else {
+                throw std::runtime_error("unknown keyword " + key);
+            }
+        } catch (const std::runtime_error& e) {
+            throw std::runtime_error(path + ":" + std::to_string(lineNo) + ": " + e.what());
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::unique_ptr<Object>> built(meshes.size());
+    std::vector<std::exception_ptr> errors(meshes.size());
+    ThreadPool::shared().parallelFor(meshes.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            try {
+                const MeshEntry& mesh = meshes[i];
+                if (!mesh.pageFile.empty() && std::ifstream(mesh.pageFile)) {
+                    built[i] = std::make_unique<OutOfCoreMesh>(mesh.pageFile, mesh.material);
+                    continue;
+                }
+                auto triangles = std::make_unique<MeshTriangle>(mesh.file, mesh.material, mesh.lazy);
+                if (mesh.scale != 1 || mesh.offset.x != 0 || mesh.offset.y != 0 || mesh.offset.z != 0)
+                    triangles->deform([&](const Vector3f& p) { return p * mesh.scale + mesh.offset; });
+                if (mesh.optimize > 0) triangles->bvh->optimize(mesh.optimize);
+                if (mesh.pageFile.empty()) {
+                    built[i] = std::move(triangles);
+                } else {//第一次加载时转换成页文件，内存中的网格随即释放
+                    OutOfCoreMesh::write(*triangles, mesh.pageFile);
+                    triangles.reset();
+                    built[i] = std::make_unique<OutOfCoreMesh>(mesh.pageFile, mesh.material);
+                }
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        }
+    });
+    for (auto& error : errors)
+        if (error) std::rethrow_exception(error);
+
+    bundle.scene = std::make_unique<Scene>(bundle.camera.width, bundle.camera.height);
+    bundle.scene->fov = bundle.camera.fov;
+    for (auto& mesh : built) {
+        bundle.scene->Add(mesh.get());
+        bundle.objects.push_back(std::move(mesh));
+    }
+    bundle.scene->buildBVH();
+    printf(" - Loaded %zu meshes from %s in %.2f s\n", meshes.size(), path.c_str(),
+           std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+    if (settings) {
+        settings->camera = bundle.camera;
+        if (spp) settings->spp = spp;
+        if (seed) settings->seed = *seed;
+    }
+    return bundle;
+}
@@ -0,0 +1,27 @@
+#ifndef RAYTRACING_SCENEFILE_H
+#define RAYTRACING_SCENEFILE_H
+#include <string>
+#include "Renderer.hpp"
+
+/*
+**场景描述文件：文本格式，每行一条"关键字 参数..."，'#'之后为注释
+**  size <w> <h>                                   输出分辨率
+**  camera [eye x y z] [target x y z] [up x y z] [fov 度]   相机，省略的项使用Camera的默认值
+**  spp <n>  seed <n>                              渲染设置
+**  material <名称> kd <r g b> [emission <r g b>]   漫反射材质；带emission的材质即光源，路径追踪对其表面采样
+**  mesh <obj文件> <材质名称> [scale s] [translate x y z] [lazy 层数] [optimize 秒] [outofcore 页文件]
+**                                                 一个网格实例，先缩放再平移
+**                                                 lazy：网格的BVH只预先构建前若干层，其余子树在光线第一次进入时构建
+**                                                 outofcore：作为外存网格(OutOfCoreMesh)按需从页文件调入；页文件不存在时
+**                                                 先由obj文件转换(施加变换之后)，已存在时直接映射而不读取obj文件，
+**                                                 修改obj文件或变换后需删除旧的页文件
+**                                                 optimize：变换后在给定的时间预算内用树旋转优化网格的BVH(BVHAccel::optimize)
+**路径相对于场景文件所在的目录；同一个obj文件可以用不同的材质和变换多次出现，每次各自持有一份顶点和BVH
+**
+**各网格的读取、顶点合并和BVH构建互相独立，作为共享线程池上的任务并行进行，最后按文件中的顺序加入场景并构建顶层BVH
+**格式错误、文件缺失时抛出std::runtime_error，信息中带有出错的行号
+*/
+//settings非空时写入文件中的相机、spp和seed
+SceneBundle loadSceneFile(const std::string& path, Renderer* settings = nullptr);
+
+#endif //RAYTRACING_SCENEFILE_H
@@ -114,6 +114,7 @@ public:
     bool hasEmit(){
         return m->hasEmission();
     }
+    Material* getMaterial() override { return m; }
 };
 
 
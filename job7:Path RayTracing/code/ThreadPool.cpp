@@ -0,0 +1,135 @@
+#include <atomic>
+#include <exception>
+#include <memory>
+#include "ThreadPool.hpp"
+
+ThreadPool::ThreadPool(unsigned threads)
+{
+    for (unsigned i = 0; i < threads; ++i)
+        workers.emplace_back([this] { workerLoop(); });
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    ready.notify_all();
+    for (auto& worker : workers)
+        worker.join();
+}
+
+static std::atomic<bool> sharedPoolCreated{false};
+
+ThreadPool& ThreadPool::shared()
+{
+    static ThreadPool pool = [] {
+        sharedPoolCreated = true;
+        return ThreadPool();
+    }();
+    return pool;
+}
+
+bool ThreadPool::sharedCreated()
+{
+    return sharedPoolCreated;
+}
+
+std::future<void> ThreadPool::submit(std::function<void()> task)
+{
+    std::packaged_task<void()> job(std::move(task));
+    std::future<void> result = job.get_future();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push(std::move(job));
+    }
+    ready.notify_one();
+    return result;
+}
+
+void ThreadPool::workerLoop()
+{
+    for (;;) {
+        std::packaged_task<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            ready.wait(lock, [this] { return stopping || !tasks.empty(); });
+            if (tasks.empty()) return;//stopping且队列已清空
+            job = std::move(tasks.front());
+            tasks.pop();
+        }
+        job();
+    }
+}
+
+namespace {
+
+//一次parallelFor的共享状态；帮手任务可能在parallelFor返回后才出队，所以放在堆上，领不到块的帮手不会再访问body
+struct ParallelForState {
+    const std::function<void(size_t, size_t)>* body;
+    size_t count, grain, chunks;
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> done{0};
+    std::atomic<bool> failed{false};
+    std::exception_ptr error;//第一个抛出的异常，由mutex保护
+    std::mutex mutex;
+    std::condition_variable finished;
+
+    //领取并执行一块，没有剩余的块时返回false
+    //body抛出的异常在这里捕获并保存，这一块仍计为完成；出错之后领取的块不再执行body，由parallelFor重新抛出
+    bool runChunk()
+    {
+        size_t c = next.fetch_add(1);
+        if (c >= chunks) return false;
+        if (!failed.load()) {
+            try {
+                (*body)(c * grain, std::min(count, (c + 1) * grain));
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error) error = std::current_exception();
+                failed = true;
+            }
+        }
+        if (done.fetch_add(1) + 1 == chunks) {
+            std::lock_guard<std::mutex> lock(mutex);
+            finished.notify_all();
+        }
+        return true;
+    }
+};
+
+//帮手每次只执行一块，然后把自己重新排到队尾：多个并发的parallelFor(如渲染服务中的多个任务)按块轮流使用工作线程
+void helpChunks(ThreadPool* pool, std::shared_ptr<ParallelForState> state)
+{
+    if (state->runChunk() && state->next.load() < state->chunks)
+        pool->submit([pool, state] { helpChunks(pool, state); });
+}
+
+}
+
+void ThreadPool::parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)>& body)
+{
+    grain = std::max<size_t>(grain, 1);
+    size_t chunks = (count + grain - 1) / grain;
+    if (chunks == 0) return;
+    if (chunks == 1 || workers.empty()) {
+        body(0, count);
+        return;
+    }
+
+    auto state = std::make_shared<ParallelForState>();
+    state->body = &body;
+    state->count = count;
+    state->grain = grain;
+    state->chunks = chunks;
+
+    size_t helpers = std::min<size_t>(workers.size(), chunks - 1);
+    for (size_t i = 0; i < helpers; ++i)
+        submit([this, state] { helpChunks(this, state); });
+    while (state->runChunk()) {}
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->finished.wait(lock, [&] { return state->done.load() == chunks; });
+    if (state->error) std::rethrow_exception(state->error);
+}
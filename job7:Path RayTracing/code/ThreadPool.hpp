@@ -0,0 +1,46 @@
+#ifndef RAYTRACING_THREADPOOL_H
+#define RAYTRACING_THREADPOOL_H
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+/*
+**固定数量工作线程的线程池，任务按提交顺序执行
+**parallelFor把[0, count)切成大小为grain的块，由工作线程和调用线程一起领取，全部完成后返回
+**工作线程每执行一块就重新排队，同时进行的多个parallelFor按块轮流获得工作线程
+**调用线程只等待块完成而不等待任务出队，因此在工作线程里嵌套调用parallelFor也不会死锁
+**body抛出异常时其余未开始的块被跳过，所有块结束后parallelFor在调用线程重新抛出第一个异常
+*/
+class ThreadPool
+{
+public:
+    explicit ThreadPool(unsigned threads = std::max(1u, std::thread::hardware_concurrency()));
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    std::future<void> submit(std::function<void()> task);
+    void parallelFor(size_t count, size_t grain, const std::function<void(size_t begin, size_t end)>& body);
+    unsigned size() const { return unsigned(workers.size()); }
+
+    //进程内共享的线程池，第一次使用时创建
+    static ThreadPool& shared();
+    //共享线程池是否已经创建；fork出的子进程只继承调用fork的线程，之后不能再使用继承来的线程池
+    static bool sharedCreated();
+
+private:
+    void workerLoop();
+
+    std::vector<std::thread> workers;
+    std::queue<std::packaged_task<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable ready;
+    bool stopping = false;
+};
+
+#endif //RAYTRACING_THREADPOOL_H
@@ -1,6 +1,7 @@
 #pragma once
 #include <cassert>
 #include <array>
+#include <map>
 #include "BVH.hpp"
 #include "Intersection.hpp"
 #include "Material.hpp"
@@ -8,7 +9,7 @@
 #include "Object.hpp"
 #include "Triangle.hpp"
 
-bool rayTriangleIntersect(const Vector3f& v0, const Vector3f& v1,
+inline bool rayTriangleIntersect(const Vector3f& v0, const Vector3f& v1,
                           const Vector3f& v2, const Vector3f& orig,
                           const Vector3f& dir, float& tnear, float& u, float& v)
 {
@@ -28,6 +29,93 @@ bool rayTriangleIntersect(const Vector3f& v0, const Vector3f& v1,
     else    return false;
 }
 
+/*
+**Möller-Trumbore光线与三角形求交(剔除背面)
+**v0为顶点，e1 = v1 - v0，e2 = v2 - v0，N为面法向量；相交时返回true，t为光线参数，u、v为重心坐标
+*/
+inline bool intersectTriangleMT(const Vector3f& v0, const Vector3f& e1, const Vector3f& e2,
+                              const Vector3f& N, const Ray& ray, double& t, double& u, double& v)
+{
+    if (dotProduct(ray.direction, N) > 0)
+        return false;
+    Vector3f pvec = crossProduct(ray.direction, e2);
+    double det = dotProduct(e1, pvec);
+    if (fabs(det) < EPSILON)
+        return false;
+
+    double det_inv = 1. / det;
+    Vector3f tvec = ray.origin - v0;
+    u = dotProduct(tvec, pvec) * det_inv;
+    if (u < 0 || u > 1)
+        return false;
+    Vector3f qvec = crossProduct(tvec, e1);
+    v = dotProduct(ray.direction, qvec) * det_inv;
+    if (v < 0 || u + v > 1)
+        return false;
+    t = dotProduct(e2, qvec) * det_inv;
+    return true;
+}
+
+/*
+**单精度水密求交(Woop et al. 2013)：以光线起点为原点，置换坐标轴并剪切，使光线方向变为+z
+**之后只需判断三条边函数的符号；相邻三角形在共享边上算出的边函数互为相反数，光线不会从缝隙漏过
+**边函数恰为0时用double重算；与Möller-Trumbore一样只接受正面(det < 0)，并要求t > 0
+*/
+inline bool intersectTriangleWatertight(const Vector3f& v0, const Vector3f& v1, const Vector3f& v2,
+                                        const Ray& ray, double& t, double& u, double& v)
+{
+    const Vector3f a = v0 - ray.origin, b = v1 - ray.origin, c = v2 - ray.origin;
+    const float az = a[ray.kz], bz = b[ray.kz], cz = c[ray.kz];
+    const float ax = float(a[ray.kx]) + ray.Sx * az, ay = float(a[ray.ky]) + ray.Sy * az;
+    const float bx = float(b[ray.kx]) + ray.Sx * bz, by = float(b[ray.ky]) + ray.Sy * bz;
+    const float cx = float(c[ray.kx]) + ray.Sx * cz, cy = float(c[ray.ky]) + ray.Sy * cz;
+
+    float e0 = bx * cy - by * cx;
+    float e1 = cx * ay - cy * ax;
+    float e2 = ax * by - ay * bx;
+    if (e0 == 0.0f || e1 == 0.0f || e2 == 0.0f) {
+        e0 = float(double(bx) * cy - double(by) * cx);
+        e1 = float(double(cx) * ay - double(cy) * ax);
+        e2 = float(double(ax) * by - double(ay) * bx);
+    }
+    if (ray.Sz < 0.0f) {//剪切空间中det = dot(N, dir) / dir[kz]，统一成det < 0为正面
+        e0 = -e0;
+        e1 = -e1;
+        e2 = -e2;
+    }
+    if (e0 > 0.0f || e1 > 0.0f || e2 > 0.0f)//在三角形外或者是背面
+        return false;
+    const float det = e0 + e1 + e2;
+    if (det == 0.0f)
+        return false;
+    const float tScaled = ray.Sz * (e0 * az + e1 * bz + e2 * cz);
+    if (tScaled >= 0.0f)//det < 0，t <= 0
+        return false;
+
+    const float invDet = 1.0f / det;
+    t = tScaled * invDet;
+    u = e1 * invDet;
+    v = e2 * invDet;
+    return true;
+}
+
+enum class TriangleKernel { Watertight, MollerTrumbore };
+
+//三角形求交所用的算法，默认为水密求交；命令行参数--mt-kernel切换回Möller-Trumbore做A/B计时
+inline TriangleKernel triangleKernel = TriangleKernel::Watertight;
+
+/*
+**Triangle、MeshFace与外存网格共用的三角形求交，按triangleKernel选择算法
+*/
+inline bool intersectTriangle(const Vector3f& v0, const Vector3f& v1, const Vector3f& v2,
+                              const Ray& ray, double& t, double& u, double& v)
+{
+    if (triangleKernel == TriangleKernel::Watertight)
+        return intersectTriangleWatertight(v0, v1, v2, ray, t, u, v);
+    Vector3f e1 = v1 - v0, e2 = v2 - v0;
+    return intersectTriangleMT(v0, e1, e2, crossProduct(e1, e2), ray, t, u, v);
+}
+
 class Triangle : public Object
 {
 public:
@@ -39,8 +127,15 @@ public:
     Material* m;//材质类型
 
     Triangle(Vector3f _v0, Vector3f _v1, Vector3f _v2, Material* _m = nullptr)
-        : v0(_v0), v1(_v1), v2(_v2), m(_m)
+        : m(_m)
     {
+        setVertices(_v0, _v1, _v2);
+    }
+
+    //更新顶点，并重新计算边向量、法向量和面积
+    void setVertices(const Vector3f& _v0, const Vector3f& _v1, const Vector3f& _v2)
+    {
+        v0 = _v0; v1 = _v1; v2 = _v2;
         e1 = v1 - v0;
         e2 = v2 - v0;
         normal = normalize(crossProduct(e1, e2));
@@ -51,6 +146,8 @@ public:
     bool intersect(const Ray& ray, float& tnear,
                    uint32_t& index) const override;
     Intersection getIntersection(Ray ray) override;
+    bool intersectHit(const Ray& ray, Hit& hit) override;
+    Intersection getSurfaceInteraction(const Ray& ray, const Hit& hit) override;
     void getSurfaceProperties(const Vector3f& P, const Vector3f& I,
                               const uint32_t& index, const Vector2f& uv,
                               Vector3f& N, Vector2f& st) const override
@@ -71,12 +168,50 @@ public:
     bool hasEmit(){
         return m->hasEmission();
     }
+    Material* getMaterial() override { return m; }
+};
+
+class MeshTriangle;
+
+/*
+**网格中的一个三角形面：只保存所属网格和面的序号，顶点、纹理坐标、材质都从网格的共享数据中读取
+**作为网格内部BVH树的叶子使用，每个面只占一个虚表指针、一个网格指针和一个序号
+*/
+class MeshFace : public Object
+{
+public:
+    MeshTriangle* mesh;//所属网格
+    uint32_t index;//面序号，顶点索引为mesh->vertexIndex[index * 3 + 0..2]
+
+    MeshFace(MeshTriangle* _mesh, uint32_t _index) : mesh(_mesh), index(_index) {}
+
+    bool intersect(const Ray& ray) override { return true; }
+    bool intersect(const Ray& ray, float& tnear, uint32_t& index) const override { return false; }
+    Intersection getIntersection(Ray ray) override;
+    bool intersectHit(const Ray& ray, Hit& hit) override;
+    void getSurfaceProperties(const Vector3f& P, const Vector3f& I,
+                              const uint32_t& index, const Vector2f& uv,
+                              Vector3f& N, Vector2f& st) const override;
+    Vector3f evalDiffuseColor(const Vector2f&) const override { return Vector3f(0.5, 0.5, 0.5); }
+    Bounds3 getBounds() override;
+    void Sample(Intersection &pos, float &pdf) override;
+    float getArea() override;
+    bool hasEmit() override;
+
+    const Vector3f& v0() const;
+    const Vector3f& v1() const;
+    const Vector3f& v2() const;
 };
 
+/*
+**索引三角形网格：共享顶点池vertices + 每个面3个32位索引vertexIndex + 整个网格共用一个材质m
+**OBJ_Loader为每个面单独展开顶点，构造时按(位置, 纹理坐标)合并相同的顶点
+*/
 class MeshTriangle : public Object
 {
 public:
-    MeshTriangle(const std::string& filename, Material *mt = new Material())
+    //lazyDepth大于0时网格内部的BVH树延迟构建(适合预览只会看到一小部分的大网格)
+    MeshTriangle(const std::string& filename, Material *mt = new Material(), int lazyDepth = 0)
     {
         objl::Loader loader;
         loader.LoadFile(filename);
@@ -85,41 +220,68 @@ public:
         assert(loader.LoadedMeshes.size() == 1);
         auto mesh = loader.LoadedMeshes[0];
 
-        Vector3f min_vert = Vector3f{std::numeric_limits<float>::infinity(),
-                                     std::numeric_limits<float>::infinity(),
-                                     std::numeric_limits<float>::infinity()};
-        Vector3f max_vert = Vector3f{-std::numeric_limits<float>::infinity(),
-                                     -std::numeric_limits<float>::infinity(),
-                                     -std::numeric_limits<float>::infinity()};
-        for (int i = 0; i < mesh.Vertices.size(); i += 3) {
-            std::array<Vector3f, 3> face_vertices;
-
-            for (int j = 0; j < 3; j++) {
-                auto vert = Vector3f(mesh.Vertices[i + j].Position.X,
-                                     mesh.Vertices[i + j].Position.Y,
-                                     mesh.Vertices[i + j].Position.Z);
-                face_vertices[j] = vert;
-
-                min_vert = Vector3f(std::min(min_vert.x, vert.x),
-                                    std::min(min_vert.y, vert.y),
-                                    std::min(min_vert.z, vert.z));
-                max_vert = Vector3f(std::max(max_vert.x, vert.x),
-                                    std::max(max_vert.y, vert.y),
-                                    std::max(max_vert.z, vert.z));
-            }
+        std::map<std::array<float, 5>, uint32_t> unique;//(位置, 纹理坐标) -> 顶点池中的序号
+        std::vector<uint32_t> indices;
+        indices.reserve(mesh.Vertices.size());
+        for (auto& vert : mesh.Vertices) {
+            std::array<float, 5> key = {vert.Position.X, vert.Position.Y, vert.Position.Z,
+                                        vert.TextureCoordinate.X, vert.TextureCoordinate.Y};
+            auto it = unique.emplace(key, (uint32_t)unique.size()).first;
+            indices.push_back(it->second);
+        }
 
-            triangles.emplace_back(face_vertices[0], face_vertices[1],
-                                   face_vertices[2], mt);
+        numVertices = unique.size();
+        numTriangles = indices.size() / 3;
+        vertices.reset(new Vector3f[numVertices]);
+        stCoordinates.reset(new Vector2f[numVertices]);
+        vertexIndex.reset(new uint32_t[numTriangles * 3]);
+        for (auto& [key, i] : unique) {
+            vertices[i] = Vector3f(key[0], key[1], key[2]);
+            stCoordinates[i] = Vector2f(key[3], key[4]);
         }
+        std::copy(indices.begin(), indices.begin() + numTriangles * 3, vertexIndex.get());
 
-        bounding_box = Bounds3(min_vert, max_vert);
+        bounding_box = Bounds3();
+        for (uint32_t i = 0; i < numVertices; ++i)
+            bounding_box = Union(bounding_box, vertices[i]);
 
+        faces.reserve(numTriangles);
         std::vector<Object*> ptrs;
-        for (auto& tri : triangles){
-            ptrs.push_back(&tri);
-            area += tri.area;
+        for (uint32_t k = 0; k < numTriangles; ++k) {
+            faces.emplace_back(this, k);
+            area += faces[k].getArea();
         }
-        bvh = new BVHAccel(ptrs);
+        for (auto& face : faces)
+            ptrs.push_back(&face);
+        bvh = new BVHAccel(ptrs, 1, BVHAccel::SplitMethod::NAIVE, lazyDepth);
+    }
+
+    //faces中保存了指向本网格的指针，不允许拷贝或移动
+    MeshTriangle(const MeshTriangle&) = delete;
+    MeshTriangle& operator=(const MeshTriangle&) = delete;
+
+    /*
+    **对所有顶点施加变换f(顶点动画、刚体变换等)，随后refit网格内部的BVH树
+    **网格加入场景后，还需调用Scene::refitBVH()更新顶层BVH树
+    */
+    template <typename F>
+    void deform(F f)
+    {
+        for (uint32_t i = 0; i < numVertices; ++i)
+            vertices[i] = f(vertices[i]);
+        refit();
+    }
+
+    void translate(const Vector3f& offset)
+    {
+        deform([&](const Vector3f& p) { return p + offset; });
+    }
+
+    void refit()
+    {
+        bvh->refit();
+        bounding_box = bvh->WorldBound();
+        area = bvh->root->area;
     }
 
     bool intersect(const Ray& ray) { return true; }
@@ -181,6 +343,34 @@ public:
 
         return intersec;
     }
+
+    //网格内部BVH树的叶子(MeshFace)会把obj设为网格本身、primId设为面序号
+    bool intersectHit(const Ray& ray, Hit& hit)
+    {
+        return bvh && bvh->IntersectHit(ray, hit);
+    }
+
+    bool intersectAny(const Ray& ray, float tMax)
+    {
+        return bvh && bvh->IntersectP(ray, tMax);
+    }
+
+    //只为最终的最近交点计算一次：交点坐标、面法向量、材质以及插值后的纹理坐标
+    Intersection getSurfaceInteraction(const Ray& ray, const Hit& hit)
+    {
+        const uint32_t* idx = &vertexIndex[hit.primId * 3];
+        const Vector3f &v0 = vertices[idx[0]], &v1 = vertices[idx[1]], &v2 = vertices[idx[2]];
+        Intersection inter;
+        inter.happened = true;
+        inter.distance = hit.t;
+        inter.coords = ray(hit.t);
+        inter.normal = normalize(crossProduct(v1 - v0, v2 - v0));
+        Vector2f st = stCoordinates[idx[0]] * (1 - hit.b1 - hit.b2) + stCoordinates[idx[1]] * hit.b1 + stCoordinates[idx[2]] * hit.b2;
+        inter.tcoords = Vector3f(st.x, st.y, 0);
+        inter.obj = this;
+        inter.m = m;
+        return inter;
+    }
     
     void Sample(Intersection &pos, float &pdf){
         bvh->Sample(pos, pdf);
@@ -192,14 +382,16 @@ public:
     bool hasEmit(){
         return m->hasEmission();
     }
+    Material* getMaterial() override { return m; }
 
     Bounds3 bounding_box;
-    std::unique_ptr<Vector3f[]> vertices;
+    std::unique_ptr<Vector3f[]> vertices;//共享顶点池
+    uint32_t numVertices;
     uint32_t numTriangles;
-    std::unique_ptr<uint32_t[]> vertexIndex;
-    std::unique_ptr<Vector2f[]> stCoordinates;
+    std::unique_ptr<uint32_t[]> vertexIndex;//每个面3个顶点索引
+    std::unique_ptr<Vector2f[]> stCoordinates;//与顶点池一一对应的纹理坐标
 
-    std::vector<Triangle> triangles;
+    std::vector<MeshFace> faces;//BVH树的叶子
 
     BVHAccel* bvh;
     float area;
@@ -207,6 +399,55 @@ public:
     Material* m;
 };
 
+inline const Vector3f& MeshFace::v0() const { return mesh->vertices[mesh->vertexIndex[index * 3]]; }
+inline const Vector3f& MeshFace::v1() const { return mesh->vertices[mesh->vertexIndex[index * 3 + 1]]; }
+inline const Vector3f& MeshFace::v2() const { return mesh->vertices[mesh->vertexIndex[index * 3 + 2]]; }
+
+inline Bounds3 MeshFace::getBounds() { return Union(Bounds3(v0(), v1()), v2()); }
+
+inline float MeshFace::getArea()
+{
+    return crossProduct(v1() - v0(), v2() - v0()).norm() * 0.5f;
+}
+
+inline bool MeshFace::hasEmit() { return mesh->m->hasEmission(); }
+
+inline void MeshFace::getSurfaceProperties(const Vector3f& P, const Vector3f& I,
+                                           const uint32_t&, const Vector2f& uv,
+                                           Vector3f& N, Vector2f& st) const
+{
+    mesh->getSurfaceProperties(P, I, index, uv, N, st);
+}
+
+inline bool MeshFace::intersectHit(const Ray& ray, Hit& hit)
+{
+    double t, u, v;
+    if (!intersectTriangle(v0(), v1(), v2(), ray, t, u, v) || t >= hit.t)
+        return false;
+    hit.t = t;
+    hit.primId = index;
+    hit.b1 = u;
+    hit.b2 = v;
+    hit.obj = mesh;
+    return true;
+}
+
+inline Intersection MeshFace::getIntersection(Ray ray)
+{
+    Hit hit;
+    if (!intersectHit(ray, hit))
+        return Intersection();
+    return mesh->getSurfaceInteraction(ray, hit);
+}
+
+inline void MeshFace::Sample(Intersection &pos, float &pdf)
+{
+    float x = std::sqrt(get_random_float()), y = get_random_float();
+    pos.coords = v0() * (1.0f - x) + v1() * (x * (1.0f - y)) + v2() * (x * y);
+    pos.normal = normalize(crossProduct(v1() - v0(), v2() - v0()));
+    pdf = 1.0f / getArea();
+}
+
 inline bool Triangle::intersect(const Ray& ray) { return true; }
 inline bool Triangle::intersect(const Ray& ray, float& tnear,
                                 uint32_t& index) const
@@ -218,34 +459,35 @@ inline Bounds3 Triangle::getBounds() { return Union(Bounds3(v0, v1), v2); }
 
 inline Intersection Triangle::getIntersection(Ray ray)
 {
-    Intersection inter;
-
-    if (dotProduct(ray.direction, normal) > 0)
-        return inter;
-    double u, v, t_tmp = 0;
-    Vector3f pvec = crossProduct(ray.direction, e2);
-    double det = dotProduct(e1, pvec);
-    if (fabs(det) < EPSILON)
-        return inter;
+    Hit hit;
+    if (!intersectHit(ray, hit))
+        return Intersection();
+    return getSurfaceInteraction(ray, hit);
+}
 
-    double det_inv = 1. / det;
-    Vector3f tvec = ray.origin - v0;
-    u = dotProduct(tvec, pvec) * det_inv;
-    if (u < 0 || u > 1)
-        return inter;
-    Vector3f qvec = crossProduct(tvec, e1);
-    v = dotProduct(ray.direction, qvec) * det_inv;
-    if (v < 0 || u + v > 1)
-        return inter;
-    t_tmp = dotProduct(e2, qvec) * det_inv;
+inline bool Triangle::intersectHit(const Ray& ray, Hit& hit)
+{
+    double t, u, v;
+    if (!intersectTriangle(v0, v1, v2, ray, t, u, v) || t >= hit.t)
+        return false;
+    hit.t = t;
+    hit.primId = 0;
+    hit.b1 = u;
+    hit.b2 = v;
+    hit.obj = this;
+    return true;
+}
 
-    // TODO find ray triangle intersection
-    inter.distance = t_tmp; // time needed to intersect
+inline Intersection Triangle::getSurfaceInteraction(const Ray& ray, const Hit& hit)
+{
+    Intersection inter;
+    inter.distance = hit.t; // time needed to intersect
     inter.obj=this;
     inter.happened = true;
     inter.normal=normal;
     inter.m=m;
-    inter.coords=ray(t_tmp); // coords=origin+t_tmp*direction
+    inter.coords=ray(hit.t); // coords=origin+t*direction
+    inter.tcoords = t0 * (1 - hit.b1 - hit.b2) + t1 * hit.b1 + t2 * hit.b2;
     return inter;
 }
 
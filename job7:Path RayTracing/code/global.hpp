@@ -1,6 +1,7 @@
 #pragma once
 #include <iostream>
 #include <cmath>
+#include <cstdint>
 #include <random>
 
 #undef M_PI
@@ -28,13 +29,53 @@ inline  bool solveQuadratic(const float &a, const float &b, const float &c, floa
     return true;
 }
 
-inline float get_random_float()
+/*
+**每个线程一个PCG32随机数发生器(O'Neill 2014)，状态只有16字节，重新设定种子几乎没有开销
+**渲染时每个(像素, 样本序号)都用seed_random重新设定种子，结果与线程调度无关，中断后也能从任意样本处继续
+*/
+struct RandomState
+{
+    uint64_t state = 0x853c49e6748fea9bull;
+    uint64_t inc = 0xda3e39cb94b95bdbull;
+
+    uint32_t next()
+    {
+        uint64_t old = state;
+        state = old * 6364136223846793005ull + inc;
+        uint32_t xorshifted = uint32_t(((old >> 18u) ^ old) >> 27u);
+        uint32_t rot = uint32_t(old >> 59u);
+        return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+    }
+};
+
+inline RandomState& thread_random_state()
 {
-    std::random_device dev;
-    std::mt19937 rng(dev());
-    std::uniform_real_distribution<float> dist(0.f, 1.f); // distribution in range [1, 6]
+    thread_local RandomState rng = [] {
+        RandomState r;
+        r.state += std::random_device()();
+        return r;
+    }();
+    return rng;
+}
+
+//用seed和序列号stream重新设定当前线程的随机数发生器，不同的stream得到互不相关的序列
+//stream先经splitmix64打散：相邻的序号直接作增量时，得到的PCG序列之间有明显的相关性
+inline void seed_random(uint64_t seed, uint64_t stream)
+{
+    stream = (stream ^ (stream >> 30)) * 0xbf58476d1ce4e5b9ull;
+    stream = (stream ^ (stream >> 27)) * 0x94d049bb133111ebull;
+    stream ^= stream >> 31;
+    RandomState& rng = thread_random_state();
+    rng.state = 0;
+    rng.inc = (stream << 1u) | 1u;
+    rng.next();
+    rng.state += seed;
+    rng.next();
+}
 
-    return dist(rng);
+inline float get_random_float()
+{
+    return (thread_random_state().next() >> 8) * (1.0f / 16777216.0f);//[0, 1)
 }
 
 inline void UpdateProgress(float progress)
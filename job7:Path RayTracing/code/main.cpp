@@ -1,10 +1,85 @@
 #include "Renderer.hpp"
+#include "Distributed.hpp"
+#include "OutOfCoreMesh.hpp"
+#include "RenderServer.hpp"
+#include "SceneFile.hpp"
 #include "Scene.hpp"
 #include "Triangle.hpp"
 #include "Sphere.hpp"
 #include "Vector.hpp"
 #include "global.hpp"
 #include <chrono>
+#include <cstring>
+#include <sys/wait.h>
+
+/*
+**--bvh-bench：用同一批相机光线对比BVHBuildNode树遍历与压缩节点遍历的吞吐量
+*/
+static void benchmarkBVH(const Scene& scene, const std::vector<BVHAccel*>& bvhs, int rounds = 4)
+{
+    float scale = tan(scene.fov * 0.5 * M_PI / 180.0);
+    float imageAspectRatio = scene.width / (float)scene.height;
+    Vector3f eye_pos(278, 273, -800);
+    std::vector<Ray> rays;
+    for (int j = 0; j < scene.height; ++j)
+        for (int i = 0; i < scene.width; ++i) {
+            float x = (2 * (i + 0.5) / (float)scene.width - 1) * imageAspectRatio * scale;
+            float y = (1 - 2 * (j + 0.5) / (float)scene.height) * scale;
+            rays.emplace_back(eye_pos, normalize(Vector3f(-x, y, 1)));
+        }
+
+    double raysPerSec[2];
+    for (int mode = 0; mode < 2; ++mode) {
+        for (auto bvh : bvhs) {
+            if (mode == 1 && bvh->compressedNodes.empty()) bvh->compress();
+            bvh->useCompressed = mode == 1;
+        }
+        auto start = std::chrono::steady_clock::now();
+        int hits = 0;
+        for (int r = 0; r < rounds; ++r)
+            for (auto& ray : rays)
+                hits += scene.intersect(ray).happened;
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        raysPerSec[mode] = rays.size() * rounds / secs;
+        printf("%s: %.2f Mrays/s (%d hits)\n", mode ? "compressed" : "reference ", raysPerSec[mode] / 1e6, hits);
+    }
+    printf("compressed / reference: %.2fx\n", raysPerSec[1] / raysPerSec[0]);
+}
+
+/*
+**--ooc-bench：在限定的驻留内存下，用同一批相机光线比较外存网格逐条求交与批量求交的调页次数
+*/
+static void benchmarkOutOfCore(OutOfCoreMesh& mesh, const Camera& camera, size_t memoryCap = size_t(64) << 10)
+{
+    std::vector<Ray> rays;
+    for (int j = 0; j < camera.height; ++j)
+        for (int i = 0; i < camera.width; ++i)
+            rays.push_back(camera.generateRay(i, j));
+
+    mesh.cache.memoryCap = memoryCap;
+    size_t pageIns[2];
+    int hits[2] = {0, 0};
+    for (int mode = 0; mode < 2; ++mode) {
+        mesh.cache.clear();
+        size_t before = mesh.cache.pageIns;
+        auto start = std::chrono::steady_clock::now();
+        if (mode == 0) {
+            for (auto& ray : rays)
+                hits[mode] += mesh.getIntersection(ray).happened;
+        } else {
+            std::vector<Intersection> result;
+            mesh.intersect(rays, result);
+            for (auto& inter : result)
+                hits[mode] += inter.happened;
+        }
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        pageIns[mode] = mesh.cache.pageIns - before;
+        printf("%s: %zu rays, %d hits, %zu page-ins, %.3f s\n", mode ? "batch " : "single", rays.size(), hits[mode],
+               pageIns[mode], secs);
+    }
+    printf("%zu clusters, %zu KB cap: batch / single page-ins %.3f\n", mesh.clusters.size(), memoryCap >> 10,
+           double(pageIns[1]) / pageIns[0]);
+}
 
 // In the main function of the program, we create the scene (create objects and
 // lights) as well as set the options for the render (image width and height,
@@ -12,42 +87,178 @@
 // function().
 int main(int argc, char** argv)
 {
+    Renderer r;
 
-    //调整不同的分辨率(Screen 上的像素总数)
-    //Scene scene(784, 784);
-    //Scene scene(1024, 1024);
-    Scene scene(160, 160);
-
-    Material* red = new Material(DIFFUSE, Vector3f(0.0f));
-    red->Kd = Vector3f(0.63f, 0.065f, 0.05f);
-    Material* green = new Material(DIFFUSE, Vector3f(0.0f));
-    green->Kd = Vector3f(0.14f, 0.45f, 0.091f);
-    Material* white = new Material(DIFFUSE, Vector3f(0.0f));
-    white->Kd = Vector3f(0.725f, 0.71f, 0.68f);
-    Material* light = new Material(DIFFUSE, (8.0f * Vector3f(0.747f+0.058f, 0.747f+0.258f, 0.747f) + 15.6f * Vector3f(0.740f+0.287f,0.740f+0.160f,0.740f) + 18.4f *Vector3f(0.737f+0.642f,0.737f+0.159f,0.737f)));
-    light->Kd = Vector3f(0.65f);
-
-    MeshTriangle floor("../models/cornellbox/floor.obj", white);
-    MeshTriangle shortbox("../models/cornellbox/shortbox.obj", white);
-    MeshTriangle tallbox("../models/cornellbox/tallbox.obj", white);
-    MeshTriangle left("../models/cornellbox/left.obj", red);
-    MeshTriangle right("../models/cornellbox/right.obj", green);
-    MeshTriangle light_("../models/cornellbox/light.obj", light);
-
-    scene.Add(&floor);
-    scene.Add(&shortbox);
-    scene.Add(&tallbox);
-    scene.Add(&left);
-    scene.Add(&right);
-    scene.Add(&light_);
-
-    scene.buildBVH();
+    bool bvhBench = false, oocBench = false, radianceCache = false, pathGuide = false;
+    bool aovs = false;//另外输出albedo.ppm、normal.ppm(0.5 * n + 0.5)和depth.ppm(按最大深度归一化)
+    std::string workerAddress, coordinatorAddress;//分布式渲染：见Distributed.hpp中的地址格式
+    std::string serverAddress, submitAddress, submitRequest;//常驻渲染服务：见RenderServer.hpp
+    std::string scenePath = "../models/cornellbox/cornellbox.scene";//场景描述文件：见SceneFile.hpp
+    int workerCount = 0, localWorkers = 0;
+    int views = 0;//大于0时绕场景一周均匀取views个视点批量渲染，输出binary_000.ppm、binary_001.ppm...
+    int frames = 0;//大于0时渲染frames帧的动画(相机每帧绕场景转0.5度)，输出frame_000.ppm、frame_001.ppm...
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--bvh-bench") == 0) bvhBench = true;
+        if (strcmp(argv[i], "--ooc-bench") == 0) oocBench = true;
+        if (strcmp(argv[i], "--mt-kernel") == 0) triangleKernel = TriangleKernel::MollerTrumbore;
+        if (strcmp(argv[i], "--restir") == 0) r.restir = true;
+        if (strcmp(argv[i], "--wavefront") == 0) r.wavefront = true;
+        if (strcmp(argv[i], "--radiance-cache") == 0) radianceCache = true;
+        if (strcmp(argv[i], "--path-guide") == 0) pathGuide = true;
+        if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) r.checkpointPath = argv[++i];
+        if (strcmp(argv[i], "--resume") == 0) r.resume = true;
+        if (strcmp(argv[i], "--worker") == 0 && i + 1 < argc) workerAddress = argv[++i];
+        if (strcmp(argv[i], "--coordinator") == 0 && i + 1 < argc) coordinatorAddress = argv[++i];
+        if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) workerCount = atoi(argv[++i]);
+        if (strcmp(argv[i], "--local-workers") == 0 && i + 1 < argc) localWorkers = atoi(argv[++i]);
+        if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc) scenePath = argv[++i];
+        if (strcmp(argv[i], "--views") == 0 && i + 1 < argc) views = atoi(argv[++i]);
+        if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) frames = atoi(argv[++i]);
+        if (strcmp(argv[i], "--time-budget") == 0 && i + 1 < argc) r.timeBudget = atof(argv[++i]);
+        if (strcmp(argv[i], "--denoise") == 0) r.denoiser = Denoiser();
+        if (strcmp(argv[i], "--stream") == 0 && i + 1 < argc) {
+            //逐图块写出：扩展名为.pfm时输出浮点图像，否则为8位PPM
+            std::string path = argv[++i];
+            bool pfm = path.size() >= 4 && path.compare(path.size() - 4, 4, ".pfm") == 0;
+            r.tileSink = std::make_shared<StreamingImageSink>(path, pfm);
+        }
+        if (strcmp(argv[i], "--aovs") == 0) aovs = true;
+        if (strcmp(argv[i], "--crop") == 0 && i + 4 < argc) {
+            r.crop = TileRect{atoi(argv[i + 1]), atoi(argv[i + 2]), atoi(argv[i + 3]), atoi(argv[i + 4])};
+            i += 4;
+        }
+        if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) serverAddress = argv[++i];
+        if (strcmp(argv[i], "--submit") == 0 && i + 2 < argc) {
+            submitAddress = argv[++i];
+            submitRequest = argv[++i];
+        }
+    }
 
-    Renderer r;
+    if (!submitAddress.empty()) {
+        std::string reply = sendRequest(submitAddress, submitRequest);
+        printf("%s\n", reply.c_str());
+        return reply.compare(0, 2, "ok") == 0 ? 0 : 1;
+    }
+
+    if (!serverAddress.empty()) {
+        //场景以文件名(不含目录和扩展名)注册，例如cornellbox
+        std::string id = scenePath.substr(scenePath.find_last_of('/') + 1);
+        id = id.substr(0, id.find('.'));
+        RenderServer server(r);
+        server.addScene(id, [scenePath] { return loadSceneFile(scenePath); });
+        server.serve(serverAddress);
+        return 0;
+    }
+
+    auto loadScene = [&] {
+        SceneBundle bundle = loadSceneFile(scenePath, &r);
+        if (radianceCache) bundle.scene->radianceCache = std::make_unique<RadianceCache>();
+        if (pathGuide) bundle.scene->pathGuide = std::make_unique<PathGuide>();
+        return bundle;
+    };
+
+    //协调者：等待workerCount个worker连接，其中localWorkers个在本机fork
+    //本机worker在加载场景之前fork，此时进程中还没有其他线程，每个worker各自加载场景
+    std::unique_ptr<Listener> listener;
+    if (!coordinatorAddress.empty()) {
+        listener = std::make_unique<Listener>(coordinatorAddress);
+        forkWorkers(loadScene, r, coordinatorAddress, localWorkers);
+    }
+
+    SceneBundle bundle = loadScene();
+    Scene& scene = *bundle.scene;
+
+    if (bvhBench) {
+        std::vector<BVHAccel*> bvhs = {scene.bvh};
+        for (auto& object : bundle.objects)
+            if (auto mesh = dynamic_cast<MeshTriangle*>(object.get()))
+                bvhs.push_back(mesh->bvh);
+        benchmarkBVH(scene, bvhs);
+        return 0;
+    }
+
+    if (oocBench) {//场景中的外存网格(mesh ... outofcore)
+        for (auto& object : bundle.objects)
+            if (auto mesh = dynamic_cast<OutOfCoreMesh*>(object.get()))
+                benchmarkOutOfCore(*mesh, bundle.camera);
+        return 0;
+    }
+
+    if (aovs) {
+        Camera camera = r.camera ? *r.camera : bundle.camera;
+        AOVBuffers aov = renderAOVs(scene, camera);
+        std::vector<Vector3f> normal(aov.normal.size()), depth(aov.depth.size());
+        float maxDepth = *std::max_element(aov.depth.begin(), aov.depth.end());
+        for (size_t k = 0; k < normal.size(); ++k) {
+            normal[k] = aov.normal[k] * 0.5f + Vector3f(0.5f);
+            depth[k] = Vector3f(maxDepth > 0 ? aov.depth[k] / maxDepth : 0);
+        }
+        PPMSink("albedo.ppm").write(aov.width, aov.height, aov.albedo);
+        PPMSink("normal.ppm").write(aov.width, aov.height, normal);
+        PPMSink("depth.ppm").write(aov.width, aov.height, depth);
+    }
+
+    if (views > 0) {
+        std::vector<Camera> cameras;
+        std::vector<std::shared_ptr<OutputSink>> sinks;
+        for (int v = 0; v < views; ++v) {
+            char name[32];
+            snprintf(name, sizeof(name), "binary_%03d.ppm", v);
+            cameras.push_back(bundle.camera.orbit(360.0f * v / views));
+            sinks.push_back(std::make_shared<PPMSink>(name));
+        }
+        auto start = std::chrono::steady_clock::now();
+        r.RenderBatch(scene, cameras, sinks, UpdateProgress);
+        printf("\n - %d views in %.2f s\n", views,
+               std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        return 0;
+    }
+
+    if (frames > 0) {
+        auto start = std::chrono::steady_clock::now();
+        r.RenderSequence(scene, frames, [&](int f) { return bundle.camera.orbit(0.5f * f); }, [](int f) {
+            char name[32];
+            snprintf(name, sizeof(name), "frame_%03d.ppm", f);
+            return std::make_shared<PPMSink>(name);
+        });
+        printf(" - %d frames in %.2f s\n", frames,
+               std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        return 0;
+    }
+
+    if (!workerAddress.empty()) {
+        runWorker(scene, r, *connectTo(workerAddress));
+        return 0;
+    }
+
+    std::unique_ptr<Coordinator> coordinator;
+    if (listener) {
+        std::vector<std::unique_ptr<Channel>> channels;
+        int expected = std::max(workerCount, localWorkers);
+        printf(" - Waiting for %d workers on %s\n", expected, coordinatorAddress.c_str());
+        while ((int)channels.size() < expected)
+            channels.push_back(listener->accept());
+        coordinator = std::make_unique<Coordinator>(std::move(channels));
+        r.coordinator = coordinator.get();
+    }
 
     auto start = std::chrono::system_clock::now();
-    r.Render(scene);
+    if (r.timeBudget > 0) {
+        //限时模式另外输出每个像素的样本数
+        auto job = r.RenderAsync(scene, std::make_shared<PPMSink>("binary.ppm"), UpdateProgress);
+        job->wait();
+        writeSampleCounts("binary_spp.pgm", job->width, job->height, job->sampleCounts());
+    } else if (r.tileSink) {
+        r.RenderAsync(scene, nullptr, UpdateProgress)->wait();
+    } else {
+        r.Render(scene);
+    }
     auto stop = std::chrono::system_clock::now();
+    if (scene.radianceCache)
+        printf(" - Radiance cache: %zu cells\n", scene.radianceCache->size());
+
+    coordinator.reset();//通知worker结束
+    while (wait(nullptr) > 0) {}
 
     std::cout << "Render complete: \n";
     std::cout << "Time taken: " << std::chrono::duration_cast<std::chrono::hours>(stop - start).count() << " hours\n";